@@ -1,11 +1,53 @@
 #include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <numeric>
+#include <sstream>
 #include <stdexcept>
+#include <streambuf>
+#include <string_view>
+#include <thread>
+#include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef DBDPP_ZSTD
+#include <zstd.h>
+#endif
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+// IORING_OP_WRITE came together with this flag in Linux 5.6, while the header itself exists since 5.1
+#ifdef IORING_FEAT_RW_CUR_POS
+#define DBDPP_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 #include <mysql++/mysql++.h>
 using mysqlpp::Connection, mysqlpp::Query, mysqlpp::Row, mysqlpp::String, mysqlpp::UseQueryResult;
 
@@ -144,13 +186,596 @@ public:
 	}
 };
 
-using PrimaryKey = std::vector<std::string>;
+// value of a single field, pointing into memory owned by someone else
+struct FieldView {
+	const char* data;
+	size_t length;
+	bool is_null;
+};
 
-struct TableData {
-	const std::string full_table_name;
-	std::map<PrimaryKey, Row> rows;
+inline FieldView view_of(const String& value) {
+	return {value.data(), value.length(), value.is_null()};
+}
+
+// how the bytes of a value are to be understood
+enum class FieldEncoding {
+	TEXT,
+	// 64-bit integers and MYSQL_TIME structures, as fetched with the binary protocol
+	INTEGER,
+	UNSIGNED_INTEGER,
+	TEMPORAL,
+};
+
+struct FieldFormat {
+	mysqlpp::mysql_type_info type;
+	FieldEncoding encoding;
+};
+
+// value as a MySQL++ string, converted to text if necessary
+inline String make_string(const FieldView& value, const FieldFormat& format) {
+	if (value.is_null || format.encoding == FieldEncoding::TEXT) {
+		return String(value.data, static_cast<String::size_type>(value.length), format.type, value.is_null);
+	}
+
+	char text[64];
+	int length = 0;
+	if (format.encoding == FieldEncoding::INTEGER) {
+		int64_t number;
+		std::memcpy(&number, value.data, sizeof(number));
+		length = std::snprintf(text, sizeof(text), "%lld", static_cast<long long>(number));
+	} else if (format.encoding == FieldEncoding::UNSIGNED_INTEGER) {
+		uint64_t number;
+		std::memcpy(&number, value.data, sizeof(number));
+		length = std::snprintf(text, sizeof(text), "%llu", static_cast<unsigned long long>(number));
+	} else {
+		MYSQL_TIME time;
+		std::memcpy(&time, value.data, sizeof(time));
+		if (time.time_type == MYSQL_TIMESTAMP_TIME) {
+			length = std::snprintf(text, sizeof(text), "%s%02u:%02u:%02u",
+			                       time.neg ? "-" : "", time.hour, time.minute, time.second);
+		} else {
+			length = std::snprintf(text, sizeof(text), "%04u-%02u-%02u", time.year, time.month, time.day);
+			if (time.time_type == MYSQL_TIMESTAMP_DATETIME) {
+				length += std::snprintf(text + length, sizeof(text) - length, " %02u:%02u:%02u",
+				                        time.hour, time.minute, time.second);
+			}
+		}
+		if (time.second_part) {
+			length += std::snprintf(text + length, sizeof(text) - length, ".%06lu", time.second_part);
+		}
+	}
+	return String(text, length, format.type);
+}
+
+// row fetched directly with the client library, pointing into its network buffer until the next row is fetched
+class RawRow {
+	MYSQL_ROW values = nullptr;
+	const unsigned long* lengths = nullptr;
+	const std::vector<mysqlpp::mysql_type_info>* types = nullptr;
+
+public:
+	RawRow() = default;
+
+	RawRow(MYSQL_ROW values, const unsigned long* lengths, const std::vector<mysqlpp::mysql_type_info>& types)
+		: values(values), lengths(lengths), types(&types) { }
+
+	[[nodiscard]] FieldView view(int index) const {
+		return {values[index], lengths[index], values[index] == nullptr};
+	}
+
+	[[nodiscard]] const mysqlpp::mysql_type_info& type(int index) const {
+		return (*types)[index];
+	}
+
+	// copies the value, so it is meant only for generating SQL statements
+	[[nodiscard]] String string(int index) const {
+		return String(values[index], lengths[index], type(index), values[index] == nullptr);
+	}
+};
+
+// uniform access to fields of all kinds of rows
+inline FieldView field_view(const Row& row, int index) {
+	return view_of(row[index]);
+}
+
+inline FieldView field_view(const RawRow& row, int index) {
+	return row.view(index);
+}
+
+inline FieldView field_view(const std::vector<String>& row, int index) {
+	return view_of(row[index]);
+}
+
+inline const String& field_string(const Row& row, int index) {
+	return row[index];
+}
+
+inline String field_string(const RawRow& row, int index) {
+	return row.string(index);
+}
+
+inline const String& field_string(const std::vector<String>& row, int index) {
+	return row[index];
+}
+
+inline FieldEncoding field_encoding(const Row&, int) {
+	return FieldEncoding::TEXT;
+}
+
+inline FieldEncoding field_encoding(const RawRow&, int) {
+	return FieldEncoding::TEXT;
+}
+
+inline FieldEncoding field_encoding(const std::vector<String>&, int) {
+	return FieldEncoding::TEXT;
+}
+
+inline size_t varint_size(uint64_t value) {
+	size_t size = 1;
+	for (; value >= 0x80; value >>= 7) {
+		++size;
+	}
+	return size;
+}
+
+inline char* write_varint(char* out, uint64_t value) {
+	for (; value >= 0x80; value >>= 7) {
+		*out++ = static_cast<char>(value | 0x80);
+	}
+	*out++ = static_cast<char>(value);
+	return out;
+}
+
+inline uint64_t read_varint(const char*& in) {
+	uint64_t value = 0;
+	for (int shift = 0; ; shift += 7) {
+		auto byte = static_cast<unsigned char>(*in++);
+		value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+		if (byte < 0x80) {
+			return value;
+		}
+	}
+}
+
+// all primary key values of a row, each prefixed with its length (see TableMetadata::pack_keys)
+using PackedKey = std::string;
+
+inline uint64_t read_uint64(const char* data) {
+	uint64_t value;
+	std::memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+inline uint32_t read_uint32(const char* data) {
+	uint32_t value;
+	std::memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+inline uint64_t multiply_and_fold(uint64_t x, uint64_t y) {
+	__uint128_t product = static_cast<__uint128_t>(x) * y;
+	return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+}
+
+// fast non-cryptographic hash of a byte string (in the spirit of wyhash)
+inline uint64_t hash_bytes(const char* data, size_t length, uint64_t seed = 0) {
+	constexpr uint64_t P0 = 0xa0761d6478bd642full, P1 = 0xe7037ed1a0b428dbull, P2 = 0x8ebc6af09c88c6e3ull;
+	uint64_t state = seed ^ multiply_and_fold(seed ^ P0, P1);
+	size_t remaining = length;
+	for (; remaining > 16; remaining -= 16, data += 16) {
+		state = multiply_and_fold(read_uint64(data) ^ P1, read_uint64(data + 8) ^ state);
+	}
+	uint64_t a = 0, b = 0;
+	if (remaining >= 8) {
+		a = read_uint64(data);
+		b = read_uint64(data + remaining - 8);
+	} else if (remaining >= 4) {
+		a = read_uint32(data);
+		b = read_uint32(data + remaining - 4);
+	} else if (remaining > 0) {
+		auto byte = [data](size_t i) { return static_cast<uint64_t>(static_cast<unsigned char>(data[i])); };
+		a = (byte(0) << 16) | (byte(remaining >> 1) << 8) | byte(remaining - 1);
+	}
+	return multiply_and_fold(P1 ^ length, multiply_and_fold(a ^ P1, b ^ state) ^ P2);
+}
+
+// 128-bit fingerprint of a sequence of values, computed as two independently seeded lanes of hash_bytes
+struct RowDigest {
+	uint64_t low = 0x243f6a8885a308d3ull;
+	uint64_t high = 0x13198a2e03707344ull;
+
+	void add(const FieldView& value) {
+		// the length is mixed in as well, so that NULL, empty values and value boundaries are all distinguished
+		const uint64_t header = value.is_null ? ~uint64_t(0) : value.length;
+		const size_t length = value.is_null ? 0 : value.length;
+		low = hash_bytes(value.data, length, low ^ header);
+		high = hash_bytes(value.data, length, high + header);
+	}
+
+	bool operator==(const RowDigest& that) const {
+		return low == that.low && high == that.high;
+	}
+
+	bool operator!=(const RowDigest& that) const {
+		return !(*this == that);
+	}
+};
+
+// open-addressing hash table of small values, each of them determining its own packed primary key via KEY_OF;
+// groups of 16 slots are probed at once (like in SwissTable)
+template<class VALUE, class KEY_OF>
+class FlatKeyMap {
+	static constexpr size_t GROUP_WIDTH = 16;
+	static constexpr int8_t EMPTY = -128;
+	static constexpr int8_t DELETED = -2;
+
+	// for every slot, EMPTY, DELETED or 7 lowest bits of the hash of its key
+	std::vector<int8_t> control;
+	std::vector<VALUE> entries;
+	KEY_OF key_of;
+	size_t size_ = 0;
+	size_t deleted = 0;
+
+	class Group {
+#ifdef __SSE2__
+		__m128i bytes;
+
+		[[nodiscard]] uint32_t match_byte(int8_t value) const {
+			return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(value)));
+		}
+
+	public:
+		explicit Group(const int8_t* group) : bytes(_mm_loadu_si128(reinterpret_cast<const __m128i*>(group))) { }
+
+		[[nodiscard]] uint32_t match_free() const {
+			// both EMPTY and DELETED are negative
+			return _mm_movemask_epi8(bytes);
+		}
+#else
+		const int8_t* group;
+
+		[[nodiscard]] uint32_t match_byte(int8_t value) const {
+			uint32_t mask = 0;
+			for (size_t i = 0; i < GROUP_WIDTH; ++i) {
+				mask |= static_cast<uint32_t>(group[i] == value) << i;
+			}
+			return mask;
+		}
+
+	public:
+		explicit Group(const int8_t* group) : group(group) { }
+
+		[[nodiscard]] uint32_t match_free() const {
+			uint32_t mask = 0;
+			for (size_t i = 0; i < GROUP_WIDTH; ++i) {
+				mask |= static_cast<uint32_t>(group[i] < 0) << i;
+			}
+			return mask;
+		}
+#endif
+
+		[[nodiscard]] uint32_t match(int8_t fingerprint) const {
+			return match_byte(fingerprint);
+		}
+
+		[[nodiscard]] uint32_t match_empty() const {
+			return match_byte(EMPTY);
+		}
+	};
+
+	[[nodiscard]] size_t group_mask() const {
+		return control.size() / GROUP_WIDTH - 1;
+	}
+
+	static int8_t fingerprint(uint64_t hash) {
+		return static_cast<int8_t>(hash & 0x7f);
+	}
+
+	// index of the slot for the given key, or of a free slot for it if not present (or npos if the table is full)
+	template<bool FOR_INSERT>
+	size_t probe(std::string_view key, uint64_t hash) const {
+		if (control.empty()) {
+			return std::string_view::npos;
+		}
+		size_t free_slot = std::string_view::npos;
+		size_t group_index = (hash >> 7) & group_mask();
+		for (size_t step = 1; step <= group_mask() + 1; ++step) {
+			const size_t first = group_index * GROUP_WIDTH;
+			Group group(&control[first]);
+			for (uint32_t mask = group.match(fingerprint(hash)); mask; mask &= mask - 1) {
+				size_t slot = first + __builtin_ctz(mask);
+				if (key_of(entries[slot]) == key) {
+					return slot;
+				}
+			}
+			if (FOR_INSERT && free_slot == std::string_view::npos) {
+				if (uint32_t mask = group.match_free()) {
+					free_slot = first + __builtin_ctz(mask);
+				}
+			}
+			if (group.match_empty()) {
+				// no key could have been placed past a group which still has an empty slot
+				return FOR_INSERT ? free_slot : std::string_view::npos;
+			}
+			group_index = (group_index + step) & group_mask();
+		}
+		return FOR_INSERT ? free_slot : std::string_view::npos;
+	}
+
+	void rehash(size_t capacity) {
+		std::vector<int8_t> old_control = std::exchange(control, std::vector<int8_t>(capacity, EMPTY));
+		std::vector<VALUE> old_entries = std::exchange(entries, std::vector<VALUE>(capacity));
+		deleted = 0;
+		for (size_t slot = 0; slot < old_control.size(); ++slot) {
+			if (old_control[slot] >= 0) {
+				std::string_view key = key_of(old_entries[slot]);
+				uint64_t hash = hash_bytes(key.data(), key.size());
+				size_t new_slot = probe<true>(key, hash);
+				control[new_slot] = fingerprint(hash);
+				entries[new_slot] = std::move(old_entries[slot]);
+			}
+		}
+	}
+
+public:
+	class iterator {
+		FlatKeyMap* map;
+		size_t slot;
+
+		void skip_free() {
+			while (slot < map->control.size() && map->control[slot] < 0) {
+				++slot;
+			}
+		}
+
+		friend class FlatKeyMap;
+
+	public:
+		iterator(FlatKeyMap* map, size_t slot) : map(map), slot(slot) {
+			skip_free();
+		}
+
+		VALUE& operator*() const {
+			return map->entries[slot];
+		}
+
+		VALUE* operator->() const {
+			return &map->entries[slot];
+		}
+
+		iterator& operator++() {
+			++slot;
+			skip_free();
+			return *this;
+		}
+
+		bool operator==(const iterator& that) const {
+			return slot == that.slot;
+		}
+
+		bool operator!=(const iterator& that) const {
+			return slot != that.slot;
+		}
+	};
+
+	explicit FlatKeyMap(KEY_OF key_of = KEY_OF()) : key_of(std::move(key_of)) { }
+
+	[[nodiscard]] size_t size() const {
+		return size_;
+	}
+
+	iterator begin() {
+		return {this, 0};
+	}
+
+	iterator end() {
+		return {this, control.size()};
+	}
+
+	iterator find(std::string_view key) {
+		size_t slot = probe<false>(key, hash_bytes(key.data(), key.size()));
+		return (slot == std::string_view::npos) ? end() : iterator(this, slot);
+	}
+
+	// returns false (and leaves the table unchanged) if the key is already present
+	bool emplace(VALUE&& value) {
+		if ((size_ + deleted + 1) * 8 > control.size() * 7) {
+			// grow only if the table is really filled with live entries, otherwise just clean it up
+			rehash(std::max<size_t>(GROUP_WIDTH, (size_ + 1) * 8 > control.size() * 3 ? 2 * control.size() : control.size()));
+		}
+		std::string_view key = key_of(value);
+		uint64_t hash = hash_bytes(key.data(), key.size());
+		size_t slot = probe<true>(key, hash);
+		if (control[slot] >= 0) {
+			return false;
+		}
+		if (control[slot] == DELETED) {
+			--deleted;
+		}
+		control[slot] = fingerprint(hash);
+		entries[slot] = std::move(value);
+		++size_;
+		return true;
+	}
+
+	void erase(iterator it) {
+		const size_t slot = it.slot;
+		const size_t first = slot - slot % GROUP_WIDTH;
+		// a group with an empty slot never made any probe sequence go further,
+		// so the erased slot can simply become empty as well, leaving no tombstone behind
+		if (Group(&control[first]).match_empty()) {
+			control[slot] = EMPTY;
+		} else {
+			control[slot] = DELETED;
+			++deleted;
+		}
+		entries[slot] = VALUE();
+		--size_;
+	}
+
+	void erase(const VALUE* value) {
+		erase(iterator(this, value - entries.data()));
+	}
+};
+
+// append-only storage for fetched rows, kept in large contiguous blocks and released all at once;
+// each record holds the packed primary key, followed either by a bitmap of NULL fields and all non-NULL values,
+// prefixed by their lengths, or just by the digest of non-key values
+class RowArena {
+public:
+	// block index in higher 32 bits, offset in the block in lower 32 bits
+	using Ref = uint64_t;
+
+	// sequential reader for the fields of a stored row
+	class StoredRow {
+		const unsigned char* nulls;
+		const char* position;
+		int index = 0;
+
+	public:
+		StoredRow(const char* record, int field_count)
+			: nulls(reinterpret_cast<const unsigned char*>(record)), position(record + (field_count + 7) / 8) { }
+
+		FieldView next() {
+			const int i = index++;
+			if (nulls[i / 8] & (1u << (i % 8))) {
+				return {nullptr, 0, true};
+			}
+			size_t length = read_varint(position);
+			const char* data = position;
+			position += length;
+			return {data, length, false};
+		}
+	};
+
+	struct KeyOf {
+		const RowArena* arena = nullptr;
+
+		std::string_view operator()(Ref ref) const {
+			return arena->key(ref);
+		}
+	};
+
+private:
+	static constexpr size_t BLOCK_BYTES = size_t(4) << 20;
+
+	std::vector<std::unique_ptr<char[]>> blocks;
+	size_t current_block = 0;
+	size_t used = BLOCK_BYTES;
+
+	char* allocate(size_t size, Ref& ref) {
+		if (size > BLOCK_BYTES) {
+			// oversized records get a block of their own, and the current block can still be filled up
+			ref = static_cast<Ref>(blocks.size()) << 32;
+			blocks.emplace_back(new char[size]);
+			return blocks.back().get();
+		}
+		if (used + size > BLOCK_BYTES) {
+			current_block = blocks.size();
+			blocks.emplace_back(new char[BLOCK_BYTES]);
+			used = 0;
+		}
+		ref = (static_cast<Ref>(current_block) << 32) | used;
+		char* address = blocks[current_block].get() + used;
+		used += size;
+		return address;
+	}
+
+	[[nodiscard]] const char* address(Ref ref) const {
+		return blocks[ref >> 32].get() + (ref & 0xffffffff);
+	}
+
+public:
+	template<class ROW>
+	Ref store(std::string_view key, const ROW& row, int field_count) {
+		const size_t bitmap_size = (field_count + 7) / 8;
+		size_t size = varint_size(key.size()) + key.size() + bitmap_size;
+		for (int index = 0; index < field_count; ++index) {
+			FieldView value = field_view(row, index);
+			if (!value.is_null) {
+				size += varint_size(value.length) + value.length;
+			}
+		}
+
+		Ref ref;
+		char* out = allocate(size, ref);
+		out = write_varint(out, key.size());
+		out = std::copy(key.begin(), key.end(), out);
+		auto* nulls = reinterpret_cast<unsigned char*>(out);
+		std::fill_n(nulls, bitmap_size, 0);
+		out += bitmap_size;
+		for (int index = 0; index < field_count; ++index) {
+			FieldView value = field_view(row, index);
+			if (value.is_null) {
+				nulls[index / 8] |= 1u << (index % 8);
+			} else {
+				out = write_varint(out, value.length);
+				out = std::copy_n(value.data, value.length, out);
+			}
+		}
+		return ref;
+	}
+
+	Ref store(std::string_view key, const RowDigest& digest) {
+		Ref ref;
+		char* out = allocate(varint_size(key.size()) + key.size() + sizeof(digest), ref);
+		out = write_varint(out, key.size());
+		out = std::copy(key.begin(), key.end(), out);
+		std::memcpy(out, &digest, sizeof(digest));
+		return ref;
+	}
+
+	[[nodiscard]] std::string_view key(Ref ref) const {
+		const char* record = address(ref);
+		size_t length = read_varint(record);
+		return {record, length};
+	}
+
+	[[nodiscard]] RowDigest digest(Ref ref) const {
+		std::string_view keys = key(ref);
+		RowDigest digest;
+		std::memcpy(&digest, keys.data() + keys.size(), sizeof(digest));
+		return digest;
+	}
+
+	[[nodiscard]] StoredRow row(Ref ref, int field_count) const {
+		std::string_view keys = key(ref);
+		return {keys.data() + keys.size(), field_count};
+	}
+
+	// recreates a stored row as a list of MySQL++ values, e.g. for generating SQL statements from it
+	void materialize(Ref ref, const std::vector<FieldFormat>& field_formats, std::vector<String>& values) const {
+		StoredRow stored_row = row(ref, static_cast<int>(field_formats.size()));
+		values.clear();
+		for (const auto& format : field_formats) {
+			values.push_back(make_string(stored_row.next(), format));
+		}
+	}
+};
+
+// broad family of a column type, which decides how its values are compared and written out
+enum class ColumnKind {
+	INTEGER, DECIMAL, FLOAT, TEMPORAL, TEXT, BINARY, BIT, OTHER
+};
+
+// definition of a single column, as described by information_schema
+struct ColumnInfo {
+	std::string name;
+	std::string data_type;   // e.g. "varchar"
+	std::string column_type; // e.g. "varchar(255)" or "int(10) unsigned"
+	ColumnKind kind = ColumnKind::OTHER;
+	bool is_unsigned = false;
+	bool is_nullable = false;
+	bool is_generated = false;
+	int key_ordinal = 0; // position in the primary key, starting from 1, or 0 if not in the primary key
+
+	[[nodiscard]] bool is_numeric() const {
+		return kind == ColumnKind::INTEGER || kind == ColumnKind::DECIMAL || kind == ColumnKind::FLOAT;
+	}
 
-	explicit TableData(std::string full_table_name) : full_table_name(std::move(full_table_name)) {
+	bool operator==(const ColumnInfo& that) const {
+		return name == that.name && kind == that.kind && is_unsigned == that.is_unsigned
+			&& is_generated == that.is_generated && key_ordinal == that.key_ordinal;
 	}
 };
 
@@ -159,47 +784,100 @@ public:
 	const int field_count;
 
 private:
-	std::vector<std::string> field_names;
+	std::vector<ColumnInfo> columns;
 	std::list<int> all_indexes;
+	// all columns except the generated ones, whose values cannot be written
+	std::list<int> writable_indexes;
+	// in the order of the primary key definition, not of the columns
 	std::list<int> primary_key_indexes;
+	// not generated ones either, as they change only together with the columns they are computed from
 	std::list<int> non_primary_key_indexes;
+	std::list<int> nullable_indexes;
 
-	typedef void (TableMetadata::*outputter_t)(Query& query, const Row&, int index) const;
+	template <class ROW>
+	using outputter_t = void (TableMetadata::*)(Query& query, const ROW&, int index) const;
 
-	void output_field(Query& query, const Row&, int index) const {
-		query << "`" << field_names[index] << "`";
+	template <class ROW>
+	void output_field(Query& query, const ROW&, int index) const {
+		query << "`" << columns[index].name << "`";
 	}
 
-	void output_value(Query& query, const Row& row, int index) const {
-		if (row[index].is_null()) {
+	template <class ROW>
+	void output_value(Query& query, const ROW& row, int index) const {
+		if (field_view(row, index).is_null) {
 			query << "NULL";
+		} else if (columns[index].is_numeric()) {
+			// numbers come from the server already formatted as valid literals
+			const String& value = field_string(row, index);
+			query.write(value.data(), value.length());
 		} else {
-			query << mysqlpp::quote << row[index];
+			query << mysqlpp::quote << field_string(row, index);
 		}
 	}
 
-	void output_null_field(Query& query, const Row& row, int index) const {
+	template <class ROW>
+	void output_null_field(Query& query, const ROW& row, int index) const {
 		query << "j.";
 		output_field(query, row, index);
 		query << " IS NULL";
 	}
 
-	void output_equal(Query& query, const Row& row, int index) const {
+	template <class ROW>
+	void output_equal(Query& query, const ROW& row, int index) const {
 		output_field(query, row, index);
 		query << '=';
 		output_value(query, row, index);
 	}
 
-	void output_diff(Query& query, const Row& row, int index) const {
-		query << "(NOT BINARY s.";
+	template <class ROW>
+	void output_order_field(Query& query, const ROW& row, int index) const {
+		if (is_ordered_natively(index)) {
+			output_field(query, row, index);
+		} else {
+			// these are compared bytewise on our side, so the server has to sort them the same way
+			query << "CAST(";
+			output_field(query, row, index);
+			query << " AS BINARY)";
+		}
+	}
+
+	// whether the order of the index is the same as that of compare_key_value, so that the server can simply walk it;
+	// this is not the case for strings with collations, TIME (with its variable width and negative values)
+	// and TIMESTAMP (shown in the session time zone, whose clock may go back)
+	[[nodiscard]] bool is_ordered_natively(int index) const {
+		switch (columns[index].kind) {
+		case ColumnKind::INTEGER:
+		case ColumnKind::DECIMAL:
+		case ColumnKind::FLOAT:
+		case ColumnKind::BINARY:
+		case ColumnKind::BIT:
+			return true;
+		case ColumnKind::TEMPORAL:
+			return columns[index].data_type != "time" && columns[index].data_type != "timestamp";
+		default:
+			return false;
+		}
+	}
+
+	template <class ROW>
+	void output_is_null(Query& query, const ROW& row, int index) const {
+		query << "ISNULL(";
 		output_field(query, row, index);
-		query << " <=> t.";
+		query << ")";
+	}
+
+	template <class ROW>
+	void output_diff(Query& query, const ROW& row, int index) const {
+		// the NULL-safe comparison is needed only for columns which can be NULL in either table
+		query << (columns[index].is_nullable ? "(NOT BINARY s." : "(BINARY s.");
+		output_field(query, row, index);
+		query << (columns[index].is_nullable ? " <=> t." : " <> t.");
 		output_field(query, row, index);
 		query << ")";
 	}
 
-	template <class LIST>
-	bool output_list(Query& query, const Row& row, outputter_t outputter, const char* delimiter,
+	template <class ROW, class LIST>
+	bool output_list(Query& query, const ROW& row, outputter_t<ROW> outputter, const char* delimiter,
 	                 const LIST& indexes) const {
 		bool writing_started = false;
 		for (int index : indexes) {
@@ -212,33 +890,136 @@ private:
 		return writing_started;
 	}
 
+	static int compare_integers(const FieldView& x, const FieldView& y) {
+		bool x_negative = x.length > 0 && x.data[0] == '-';
+		bool y_negative = y.length > 0 && y.data[0] == '-';
+		if (x_negative != y_negative) {
+			return x_negative ? -1 : 1;
+		}
+		// for numbers without leading zeros, the longer one has the greater magnitude
+		int result = (x.length < y.length) ? -1 : (x.length > y.length) ? 1 : std::memcmp(x.data, y.data, x.length);
+		return x_negative ? -result : result;
+	}
+
+	static int compare_bytes(const FieldView& x, const FieldView& y) {
+		int result = std::memcmp(x.data, y.data, std::min(x.length, y.length));
+		if (result == 0 && x.length != y.length) {
+			result = (x.length < y.length) ? -1 : 1;
+		}
+		return result;
+	}
+
+	// decimals of a column all have the same scale, e.g. "-12.50", so only the integer parts may differ in length
+	static int compare_decimals(const FieldView& x, const FieldView& y) {
+		bool x_negative = x.length > 0 && x.data[0] == '-';
+		bool y_negative = y.length > 0 && y.data[0] == '-';
+		if (x_negative != y_negative) {
+			return x_negative ? -1 : 1;
+		}
+		auto integer_length = [](const FieldView& value) {
+			const void* dot = std::memchr(value.data, '.', value.length);
+			return dot ? static_cast<size_t>(static_cast<const char*>(dot) - value.data) : value.length;
+		};
+		size_t x_length = integer_length(x);
+		size_t y_length = integer_length(y);
+		int result = (x_length < y_length) ? -1 : (x_length > y_length) ? 1 : compare_bytes(x, y);
+		return x_negative ? -result : result;
+	}
+
+	// floating point values may come in the exponent notation, so they are simply parsed
+	static int compare_floats(const FieldView& x, const FieldView& y) {
+		double x_value = std::strtod(std::string(x.data, x.length).c_str(), nullptr);
+		double y_value = std::strtod(std::string(y.data, y.length).c_str(), nullptr);
+		return (x_value < y_value) ? -1 : (x_value > y_value) ? 1 : 0;
+	}
+
+	[[nodiscard]] int compare_key_value(int index, const FieldView& x, const FieldView& y) const {
+		switch (columns[index].kind) {
+		case ColumnKind::INTEGER: return compare_integers(x, y);
+		case ColumnKind::DECIMAL: return compare_decimals(x, y);
+		case ColumnKind::FLOAT: return compare_floats(x, y);
+		default: return compare_bytes(x, y);
+		}
+	}
+
 public:
-	TableMetadata(std::vector<std::string> field_names, std::list<int> primary_key_indexes)
-		: field_count(static_cast<int>(field_names.size())), field_names(std::move(field_names)),
-		  primary_key_indexes(std::move(primary_key_indexes)) {
-		if (this->field_names.size() > std::numeric_limits<int>::max()) {
+	explicit TableMetadata(std::vector<ColumnInfo> columns)
+		: field_count(static_cast<int>(columns.size())), columns(std::move(columns)) {
+		if (this->columns.size() > std::numeric_limits<int>::max()) {
 			throw std::runtime_error("strangely too many columns in database");
 		}
+		std::vector<int> key_indexes;
 		for (int i = 0; i < field_count; ++i) {
+			const ColumnInfo& column = this->columns[i];
 			all_indexes.push_back(i);
+			if (column.key_ordinal > 0) {
+				key_indexes.push_back(i);
+			} else if (!column.is_generated) {
+				non_primary_key_indexes.push_back(i);
+			}
+			if (!column.is_generated) {
+				writable_indexes.push_back(i);
+			}
+			if (column.is_nullable) {
+				nullable_indexes.push_back(i);
+			}
 		}
-		std::set_difference(
-			all_indexes.begin(), all_indexes.end(),
-			this->primary_key_indexes.begin(), this->primary_key_indexes.end(),
-			std::inserter(non_primary_key_indexes, non_primary_key_indexes.end())
-		);
+		std::sort(key_indexes.begin(), key_indexes.end(), [&](int x, int y) {
+			return this->columns[x].key_ordinal < this->columns[y].key_ordinal;
+		});
+		primary_key_indexes.assign(key_indexes.begin(), key_indexes.end());
 	}
 
 	bool operator!=(const TableMetadata& that) const {
-		return field_names != that.field_names || primary_key_indexes != that.primary_key_indexes;
+		return columns != that.columns;
+	}
+
+	// nullability may differ between the tables, and the columns are then treated as nullable on both sides,
+	// so that the comparisons remain NULL-safe, and the checksums are computed in the same way
+	void allow_nulls_of(const TableMetadata& that) {
+		nullable_indexes.clear();
+		for (int i = 0; i < field_count; ++i) {
+			columns[i].is_nullable = columns[i].is_nullable || that.columns[i].is_nullable;
+			if (columns[i].is_nullable) {
+				nullable_indexes.push_back(i);
+			}
+		}
+	}
+
+	[[nodiscard]] const ColumnInfo& column(int index) const {
+		return columns[index];
+	}
+
+	// index of the only primary key field if it is an integer one, or -1 otherwise
+	[[nodiscard]] int single_integer_key() const {
+		if (primary_key_indexes.size() == 1 && columns[primary_key_indexes.front()].kind == ColumnKind::INTEGER) {
+			return primary_key_indexes.front();
+		}
+		return -1;
 	}
 
-	template <class LIST>
-	bool output_equal_list_for_update(Query& query, const Row& row, const LIST& indexes) const {
-		return output_list(query, row, &TableMetadata::output_equal, ",", indexes);
+	[[nodiscard]] bool is_unsigned(int index) const {
+		return columns[index].is_unsigned;
 	}
 
-	bool output_equal_list_for_where(Query& query, const Row& row) const {
+	[[nodiscard]] bool is_generated(int index) const {
+		return columns[index].is_generated;
+	}
+
+	[[nodiscard]] const std::list<int>& primary_keys() const {
+		return primary_key_indexes;
+	}
+
+	[[nodiscard]] const std::list<int>& non_primary_keys() const {
+		return non_primary_key_indexes;
+	}
+
+	[[nodiscard]] const std::list<int>& writable_fields() const {
+		return writable_indexes;
+	}
+
+	template <class ROW>
+	bool output_equal_list_for_where(Query& query, const ROW& row) const {
 		return output_list(query, row, &TableMetadata::output_equal, " AND ", primary_key_indexes);
 	}
 
@@ -254,140 +1035,1962 @@ public:
 		return output_list(query, row, &TableMetadata::output_field, ",", primary_key_indexes);
 	}
 
-	bool output_field_list_for_insert(Query& query, const Row& row) const {
-		return output_list(query, row, &TableMetadata::output_field, ",", all_indexes);
+	// whether the target row is missing from a LEFT JOIN, which is enough to check with a single primary key field
+	void output_missing_target_for_where(Query& query) const {
+		query << "t.";
+		output_field(query, Row(), primary_key_indexes.front());
+		query << " IS NULL";
 	}
 
-	bool output_value_list_for_insert(Query& query, const Row& row) const {
-		return output_list(query, row, &TableMetadata::output_value, ",", all_indexes);
+	bool output_key_list_for_order_by(Query& query, const Row& row) const {
+		return output_list(query, row, &TableMetadata::output_order_field, ",", primary_key_indexes);
 	}
 
-	[[nodiscard]] PrimaryKey extract_keys(const Row& row) const {
-		PrimaryKey keys;
-		for (int index : primary_key_indexes) {
-			std::string key;
-			row[index].to_string(key);
-			keys.emplace_back(std::move(key));
+	// lower (inclusive) and upper (exclusive) bounds for primary keys, where empty rows stand for no bound
+	void output_key_range_for_where(Query& query, const Row& lower, const Row& upper) const {
+		if (!lower && !upper) {
+			query << "TRUE";
+			return;
+		}
+		if (lower) {
+			query << "(";
+			output_list(query, lower, &TableMetadata::output_field, ",", primary_key_indexes);
+			query << ")>=(";
+			output_list(query, lower, &TableMetadata::output_value, ",", primary_key_indexes);
+			query << ")";
+		}
+		if (lower && upper) {
+			query << " AND ";
+		}
+		if (upper) {
+			query << "(";
+			output_list(query, upper, &TableMetadata::output_field, ",", primary_key_indexes);
+			query << ")<(";
+			output_list(query, upper, &TableMetadata::output_value, ",", primary_key_indexes);
+			query << ")";
 		}
-		return keys;
 	}
-};
 
-template<class VISITOR>
-void process_rows_from_query(Connection& conn, Query& query, VISITOR visitor) {
-	if (UseQueryResult res = query.use()) {
-		while (Row row = res.fetch_row()) {
-			visitor(row);
+	// aggregate checksum of all rows, computed by the server the same way as pt-table-checksum does
+	void output_checksum_for_select(Query& query) const {
+		query << "COALESCE(BIT_XOR(CAST(CONV(LEFT(MD5(CONCAT_WS('#',";
+		output_list(query, Row(), &TableMetadata::output_field, ",", all_indexes);
+		// CONCAT_WS skips NULLs, so they are told apart from empty strings by a flag for every nullable column
+		if (!nullable_indexes.empty()) {
+			query << ",CONCAT(";
+			output_list(query, Row(), &TableMetadata::output_is_null, ",", nullable_indexes);
+			query << ")";
 		}
+		query << ")),16),16,10) AS UNSIGNED)),0)";
 	}
-}
 
-template<class VISITOR>
-void process_rows_from_query(Connection& conn, const std::string& sql, VISITOR visitor) {
-	if (Query query = conn.query(sql)) {
-		process_rows_from_query<VISITOR>(conn, query, visitor);
+	// packs the keys into a buffer which can be reused, so that it does not need to be allocated for every row
+	template <class ROW>
+	void pack_keys(const ROW& row, PackedKey& keys) const {
+		keys.clear();
+		for (int index : primary_key_indexes) {
+			FieldView value = field_view(row, index);
+			auto length = static_cast<uint32_t>(value.length);
+			keys.append(reinterpret_cast<const char*>(&length), sizeof(length));
+			keys.append(value.data, length);
+		}
 	}
-}
 
-TableMetadata extract_table_metadata(Connection& conn, const std::string& full_table_name) {
-	std::vector<std::string> field_names;
-	std::list<int> primary_key_indexes;
-	int index = 0;
-	process_rows_from_query(conn, "DESCRIBE " + full_table_name, [&](const Row& row) {
-		field_names.emplace_back(row["Field"]);
-		if (row["Key"] == "PRI") {
-			primary_key_indexes.push_back(index);
+	// recreates a row with only the primary key values filled in from their packed form
+	void unpack_keys(std::string_view keys, const std::vector<FieldFormat>& field_formats,
+	                 std::vector<String>& row) const {
+		row.assign(field_count, String());
+		const char* position = keys.data();
+		for (int index : primary_key_indexes) {
+			uint32_t length = read_uint32(position);
+			row[index] = make_string({position + sizeof(length), length, false}, field_formats[index]);
+			position += sizeof(length) + length;
 		}
-		++index;
-	});
-	return {std::move(field_names), std::move(primary_key_indexes)};
-}
+	}
+
+	template <class ROW>
+	[[nodiscard]] RowDigest digest_non_keys(const ROW& row) const {
+		RowDigest digest;
+		for (int index : non_primary_key_indexes) {
+			digest.add(field_view(row, index));
+		}
+		return digest;
+	}
+
+	// compares primary keys of two rows consistently with ORDER BY from output_key_list_for_order_by: numbers
+	// by their values, and other values bytewise, which for strings is the order of the index only with binary collations
+	template <class ROW1, class ROW2>
+	[[nodiscard]] int compare_keys(const ROW1& x, const ROW2& y) const {
+		for (int index : primary_key_indexes) {
+			int result = compare_key_value(index, field_view(x, index), field_view(y, index));
+			if (result != 0) {
+				return result;
+			}
+		}
+		return 0;
+	}
+
+	// the same as compare_keys, but for the keys of the first row already packed by pack_keys
+	template <class ROW>
+	[[nodiscard]] int compare_packed_keys(std::string_view keys, const ROW& y) const {
+		const char* position = keys.data();
+		for (int index : primary_key_indexes) {
+			uint32_t length = read_uint32(position);
+			position += sizeof(length);
+			int result = compare_key_value(index, {position, length, false}, field_view(y, index));
+			if (result != 0) {
+				return result;
+			}
+			position += length;
+		}
+		return 0;
+	}
+};
+
+template<class VISITOR>
+void process_rows_from_query(Connection& conn, Query& query, VISITOR visitor) {
+	if (UseQueryResult res = query.use()) {
+		while (Row row = res.fetch_row()) {
+			visitor(row);
+		}
+	}
+}
+
+template<class VISITOR>
+void process_rows_from_query(Connection& conn, const std::string& sql, VISITOR visitor) {
+	if (Query query = conn.query(sql)) {
+		process_rows_from_query<VISITOR>(conn, query, visitor);
+	}
+}
+
+// index of stored rows by their packed primary keys, for any kind of keys
+class PackedKeyIndex {
+	FlatKeyMap<RowArena::Ref, RowArena::KeyOf> rows;
+	// keys being looked up are packed here, and compared directly with the ones stored in the arena
+	PackedKey lookup_keys;
+
+public:
+	PackedKeyIndex(const RowArena& arena, const TableMetadata&) : rows(RowArena::KeyOf{&arena}) { }
+
+	template <class ROW>
+	void insert(const TableMetadata&, const ROW&, RowArena::Ref ref) {
+		rows.emplace(std::move(ref));
+	}
+
+	void finish_inserting() { }
+
+	template <class ROW>
+	[[nodiscard]] RowArena::Ref* find(const TableMetadata& metadata, const ROW& row) {
+		metadata.pack_keys(row, lookup_keys);
+		auto it = rows.find(lookup_keys);
+		return (it == rows.end()) ? nullptr : &*it;
+	}
+
+	void erase(RowArena::Ref* ref) {
+		rows.erase(ref);
+	}
+
+	template<class VISITOR>
+	void for_each(VISITOR visitor) {
+		for (RowArena::Ref ref : rows) {
+			visitor(ref);
+		}
+	}
+};
 
-TableData fetch_table_data(Connection& conn, const TableMetadata& metadata, const std::string& full_table_name) {
-	TableData table_data(full_table_name);
-	process_rows_from_query(conn, "SELECT * FROM " + full_table_name, [&](Row& row) {
-		PrimaryKey keys = metadata.extract_keys(row);
-		table_data.rows.emplace(std::move(keys), std::move(row));
+// value of an integer field, mapped to an unsigned integer with the same order (and the same distances)
+template <class ROW>
+uint64_t ordered_integer(const ROW& row, int index, bool is_unsigned) {
+	FieldView value = field_view(row, index);
+	switch (field_encoding(row, index)) {
+	case FieldEncoding::INTEGER:
+		return read_uint64(value.data) ^ (uint64_t(1) << 63);
+	case FieldEncoding::UNSIGNED_INTEGER:
+		return read_uint64(value.data);
+	default:
+		break;
+	}
+	const char* position = value.data;
+	const char* end = position + value.length;
+	const bool negative = (position != end && *position == '-');
+	if (negative) {
+		++position;
+	}
+	uint64_t magnitude = 0;
+	for (; position != end; ++position) {
+		magnitude = magnitude * 10 + (*position - '0');
+	}
+	if (is_unsigned) {
+		return magnitude;
+	}
+	return (negative ? -magnitude : magnitude) ^ (uint64_t(1) << 63);
+}
+
+// the other way round, as an SQL literal
+inline std::string ordered_integer_literal(uint64_t value, bool is_unsigned) {
+	if (is_unsigned) {
+		return std::to_string(value);
+	}
+	return std::to_string(static_cast<int64_t>(value ^ (uint64_t(1) << 63)));
+}
+
+// index of stored rows by a single integer primary key: a plain array if the keys are dense enough,
+// or a radix-sorted array of keys otherwise
+class IntegerKeyIndex {
+	static constexpr RowArena::Ref ERASED = ~RowArena::Ref(0);
+
+	const int key_index;
+	const bool key_unsigned;
+	std::vector<std::pair<uint64_t, RowArena::Ref>> sorted;
+	std::vector<RowArena::Ref> dense;
+	uint64_t dense_first = 0;
+
+	template <class ROW>
+	[[nodiscard]] uint64_t extract_key(const ROW& row) const {
+		return ordered_integer(row, key_index, key_unsigned);
+	}
+
+	// LSD radix sort by bytes of keys, skipping the bytes which are the same for all keys
+	void radix_sort() {
+		std::vector<std::pair<uint64_t, RowArena::Ref>> buffer(sorted.size());
+		for (int shift = 0; shift < 64; shift += 8) {
+			size_t counts[256] = {};
+			for (const auto& entry : sorted) {
+				++counts[(entry.first >> shift) & 0xff];
+			}
+			if (std::find(std::begin(counts), std::end(counts), sorted.size()) != std::end(counts)) {
+				continue;
+			}
+			size_t offset = 0;
+			for (size_t& count : counts) {
+				offset += std::exchange(count, offset);
+			}
+			for (const auto& entry : sorted) {
+				buffer[counts[(entry.first >> shift) & 0xff]++] = entry;
+			}
+			sorted.swap(buffer);
+		}
+	}
+
+public:
+	IntegerKeyIndex(const RowArena&, const TableMetadata& metadata)
+		: key_index(metadata.single_integer_key()), key_unsigned(metadata.is_unsigned(key_index)) { }
+
+	template <class ROW>
+	void insert(const TableMetadata&, const ROW& row, RowArena::Ref ref) {
+		sorted.emplace_back(extract_key(row), ref);
+	}
+
+	void finish_inserting() {
+		if (sorted.empty()) {
+			return;
+		}
+		auto [min, max] = std::minmax_element(sorted.begin(), sorted.end());
+		const uint64_t span = max->first - min->first;
+		if (span < 2 * sorted.size()) {
+			// typical for auto-increment keys: every key can be looked up directly
+			dense_first = min->first;
+			dense.assign(span + 1, ERASED);
+			for (const auto& [key, ref] : sorted) {
+				dense[key - dense_first] = ref;
+			}
+			sorted.clear();
+			sorted.shrink_to_fit();
+		} else {
+			radix_sort();
+		}
+	}
+
+	template <class ROW>
+	[[nodiscard]] RowArena::Ref* find(const TableMetadata&, const ROW& row) {
+		const uint64_t key = extract_key(row);
+		RowArena::Ref* ref;
+		if (!dense.empty()) {
+			if (key - dense_first >= dense.size()) {
+				return nullptr;
+			}
+			ref = &dense[key - dense_first];
+		} else {
+			auto it = std::lower_bound(sorted.begin(), sorted.end(), std::make_pair(key, RowArena::Ref(0)));
+			if (it == sorted.end() || it->first != key) {
+				return nullptr;
+			}
+			ref = &it->second;
+		}
+		return (*ref == ERASED) ? nullptr : ref;
+	}
+
+	void erase(RowArena::Ref* ref) {
+		*ref = ERASED;
+	}
+
+	// visits the remaining rows in the order of their keys
+	template<class VISITOR>
+	void for_each(VISITOR visitor) {
+		for (RowArena::Ref ref : dense) {
+			if (ref != ERASED) {
+				visitor(ref);
+			}
+		}
+		for (const auto& entry : sorted) {
+			if (entry.second != ERASED) {
+				visitor(entry.second);
+			}
+		}
+	}
+};
+
+template<class INDEX>
+struct TableData {
+	const std::string full_table_name;
+	// if set, only primary keys and digests of other values are stored
+	const bool digest_only;
+	RowArena arena;
+	INDEX rows;
+	// types and encodings of fields as reported for the fetched rows
+	std::vector<FieldFormat> field_formats;
+
+	TableData(std::string full_table_name, bool digest_only, const TableMetadata& metadata)
+		: full_table_name(std::move(full_table_name)), digest_only(digest_only), rows(arena, metadata) {
+	}
+
+	// rows refer to the arena by its address
+	TableData(const TableData&) = delete;
+	TableData& operator=(const TableData&) = delete;
+};
+
+// result of a query read row by row directly with the client library, without copying the values
+class RawResult {
+	MYSQL* mysql;
+	MYSQL_RES* result = nullptr;
+	std::vector<mysqlpp::mysql_type_info> types;
+
+public:
+	using row_type = RawRow;
+
+	RawResult(Connection& conn, const std::string& sql) : mysql(conn.driver()->raw_handle()) {
+		if (mysql_real_query(mysql, sql.data(), sql.size()) != 0 || !(result = mysql_use_result(mysql))) {
+			throw std::runtime_error(mysql_error(mysql));
+		}
+		MYSQL_FIELD* fields = mysql_fetch_fields(result);
+		types.assign(fields, fields + mysql_num_fields(result));
+	}
+
+	~RawResult() {
+		mysql_free_result(result);
+	}
+
+	RawResult(const RawResult&) = delete;
+	RawResult& operator=(const RawResult&) = delete;
+
+	bool fetch(RawRow& row) {
+		MYSQL_ROW values = mysql_fetch_row(result);
+		if (!values) {
+			if (mysql_errno(mysql)) {
+				throw std::runtime_error(mysql_error(mysql));
+			}
+			return false;
+		}
+		row = RawRow(values, mysql_fetch_lengths(result), types);
+		return true;
+	}
+};
+
+// row fetched with the binary protocol, pointing into buffers which are overwritten by the next fetch
+class BinaryRow {
+	const MYSQL_BIND* binds = nullptr;
+	const FieldFormat* formats = nullptr;
+
+public:
+	BinaryRow() = default;
+
+	BinaryRow(const MYSQL_BIND* binds, const FieldFormat* formats) : binds(binds), formats(formats) { }
+
+	[[nodiscard]] FieldView view(int index) const {
+		const MYSQL_BIND& bind = binds[index];
+		if (*bind.is_null) {
+			return {nullptr, 0, true};
+		}
+		size_t length = (formats[index].encoding == FieldEncoding::TEXT) ? *bind.length : bind.buffer_length;
+		return {static_cast<const char*>(bind.buffer), length, false};
+	}
+
+	[[nodiscard]] const mysqlpp::mysql_type_info& type(int index) const {
+		return formats[index].type;
+	}
+
+	[[nodiscard]] FieldEncoding encoding(int index) const {
+		return formats[index].encoding;
+	}
+
+	[[nodiscard]] String string(int index) const {
+		return make_string(view(index), formats[index]);
+	}
+};
+
+inline FieldView field_view(const BinaryRow& row, int index) {
+	return row.view(index);
+}
+
+inline String field_string(const BinaryRow& row, int index) {
+	return row.string(index);
+}
+
+inline FieldEncoding field_encoding(const BinaryRow& row, int index) {
+	return row.encoding(index);
+}
+
+// result of a query executed as a server-side prepared statement, so that the binary protocol is used:
+// integer and temporal values arrive (and are compared) in their fixed-width form, without formatting them as text
+class BinaryResult {
+	static constexpr unsigned long INITIAL_TEXT_LENGTH = 256;
+
+	// MySQL and MariaDB disagree whether flags are bool or my_bool
+	using flag_t = std::remove_pointer_t<decltype(MYSQL_BIND::is_null)>;
+
+	MYSQL_STMT* statement;
+	std::vector<MYSQL_BIND> binds;
+	std::vector<FieldFormat> formats;
+	std::vector<std::vector<char>> buffers;
+	std::vector<unsigned long> lengths;
+	// not vectors, since std::vector<bool> cannot hand out pointers to its elements
+	std::unique_ptr<flag_t[]> nulls;
+	std::unique_ptr<flag_t[]> truncations;
+
+	[[noreturn]] void fail() const {
+		throw std::runtime_error(mysql_stmt_error(statement));
+	}
+
+public:
+	using row_type = BinaryRow;
+
+	BinaryResult(Connection& conn, const std::string& sql) : statement(mysql_stmt_init(conn.driver()->raw_handle())) {
+		if (!statement) {
+			throw std::runtime_error("cannot create a prepared statement");
+		}
+		try {
+			if (mysql_stmt_prepare(statement, sql.data(), sql.size()) != 0) {
+				fail();
+			}
+			MYSQL_RES* metadata = mysql_stmt_result_metadata(statement);
+			if (!metadata) {
+				fail();
+			}
+			const unsigned int field_count = mysql_num_fields(metadata);
+			const MYSQL_FIELD* fields = mysql_fetch_fields(metadata);
+			binds.assign(field_count, MYSQL_BIND());
+			buffers.resize(field_count);
+			lengths.assign(field_count, 0);
+			nulls = std::make_unique<flag_t[]>(field_count);
+			truncations = std::make_unique<flag_t[]>(field_count);
+			for (unsigned int index = 0; index < field_count; ++index) {
+				const MYSQL_FIELD& field = fields[index];
+				const bool is_unsigned = (field.flags & UNSIGNED_FLAG);
+				FieldEncoding encoding = FieldEncoding::TEXT;
+				MYSQL_BIND& bind = binds[index];
+				switch (field.type) {
+				case MYSQL_TYPE_TINY: case MYSQL_TYPE_SHORT: case MYSQL_TYPE_INT24:
+				case MYSQL_TYPE_LONG: case MYSQL_TYPE_LONGLONG: case MYSQL_TYPE_YEAR:
+					encoding = is_unsigned ? FieldEncoding::UNSIGNED_INTEGER : FieldEncoding::INTEGER;
+					bind.buffer_type = MYSQL_TYPE_LONGLONG;
+					bind.is_unsigned = is_unsigned;
+					buffers[index].resize(sizeof(int64_t));
+					break;
+				case MYSQL_TYPE_DATE: case MYSQL_TYPE_DATETIME: case MYSQL_TYPE_TIMESTAMP: case MYSQL_TYPE_TIME:
+					encoding = FieldEncoding::TEMPORAL;
+					bind.buffer_type = field.type;
+					buffers[index].resize(sizeof(MYSQL_TIME));
+					break;
+				default:
+					bind.buffer_type = MYSQL_TYPE_STRING;
+					buffers[index].resize(INITIAL_TEXT_LENGTH);
+					break;
+				}
+				formats.push_back({mysqlpp::mysql_type_info(field), encoding});
+				bind.buffer = buffers[index].data();
+				bind.buffer_length = buffers[index].size();
+				bind.length = &lengths[index];
+				bind.is_null = &nulls[index];
+				bind.error = &truncations[index];
+			}
+			mysql_free_result(metadata);
+
+			if (mysql_stmt_execute(statement) != 0 || mysql_stmt_bind_result(statement, binds.data()) != 0) {
+				fail();
+			}
+		}
+		catch (...) {
+			mysql_stmt_close(statement);
+			throw;
+		}
+	}
+
+	~BinaryResult() {
+		mysql_stmt_close(statement);
+	}
+
+	BinaryResult(const BinaryResult&) = delete;
+	BinaryResult& operator=(const BinaryResult&) = delete;
+
+	bool fetch(BinaryRow& row) {
+		int status = mysql_stmt_fetch(statement);
+		if (status == MYSQL_NO_DATA) {
+			return false;
+		}
+		if (status == MYSQL_DATA_TRUNCATED) {
+			// text buffers grow as needed, and the truncated values are fetched once again
+			for (size_t index = 0; index < binds.size(); ++index) {
+				if (truncations[index]) {
+					buffers[index].resize(lengths[index]);
+					binds[index].buffer = buffers[index].data();
+					binds[index].buffer_length = buffers[index].size();
+					if (mysql_stmt_fetch_column(statement, &binds[index], index, 0) != 0) {
+						fail();
+					}
+				}
+			}
+			if (mysql_stmt_bind_result(statement, binds.data()) != 0) {
+				fail();
+			}
+		} else if (status != 0) {
+			fail();
+		}
+		row = BinaryRow(binds.data(), formats.data());
+		return true;
+	}
+};
+
+// the same as process_rows_from_query, but each row is valid only until the visitor returns;
+// RESULT (RawResult or BinaryResult) determines how the rows are fetched
+template<class RESULT, class VISITOR>
+void process_raw_rows_from_query(Connection& conn, const std::string& sql, VISITOR visitor) {
+	RESULT result(conn, sql);
+	typename RESULT::row_type row;
+	while (result.fetch(row)) {
+		visitor(row);
+	}
+}
+
+// stream of rows from a single query, which can be advanced independently of other streams
+class RowStream {
+	const TableMetadata& metadata;
+	RawResult result;
+	RawRow current;
+	bool has_row;
+	// the current row is gone after advancing, but its keys are still needed to check the order
+	PackedKey previous_keys;
+
+public:
+	RowStream(const TableMetadata& metadata, Connection& conn, const std::string& sql)
+		: metadata(metadata), result(conn, sql) {
+		has_row = result.fetch(current);
+	}
+
+	[[nodiscard]] bool finished() const {
+		return !has_row;
+	}
+
+	[[nodiscard]] const RawRow& row() const {
+		return current;
+	}
+
+	void advance() {
+		metadata.pack_keys(current, previous_keys);
+		has_row = result.fetch(current);
+		if (has_row && metadata.compare_packed_keys(previous_keys, current) >= 0) {
+			throw std::runtime_error("rows are not returned in primary key order");
+		}
+	}
+};
+
+ColumnKind column_kind(const std::string& data_type) {
+	static const std::map<std::string, ColumnKind> kinds = {
+		{"tinyint", ColumnKind::INTEGER}, {"smallint", ColumnKind::INTEGER}, {"mediumint", ColumnKind::INTEGER},
+		{"int", ColumnKind::INTEGER}, {"bigint", ColumnKind::INTEGER},
+		{"decimal", ColumnKind::DECIMAL}, {"float", ColumnKind::FLOAT}, {"double", ColumnKind::FLOAT},
+		{"date", ColumnKind::TEMPORAL}, {"datetime", ColumnKind::TEMPORAL}, {"timestamp", ColumnKind::TEMPORAL},
+		{"time", ColumnKind::TEMPORAL}, {"year", ColumnKind::TEMPORAL},
+		{"char", ColumnKind::TEXT}, {"varchar", ColumnKind::TEXT}, {"tinytext", ColumnKind::TEXT},
+		{"text", ColumnKind::TEXT}, {"mediumtext", ColumnKind::TEXT}, {"longtext", ColumnKind::TEXT},
+		{"enum", ColumnKind::TEXT}, {"set", ColumnKind::TEXT},
+		{"binary", ColumnKind::BINARY}, {"varbinary", ColumnKind::BINARY}, {"tinyblob", ColumnKind::BINARY},
+		{"blob", ColumnKind::BINARY}, {"mediumblob", ColumnKind::BINARY}, {"longblob", ColumnKind::BINARY},
+		{"bit", ColumnKind::BIT},
+	};
+	auto it = kinds.find(data_type);
+	return (it != kinds.end()) ? it->second : ColumnKind::OTHER;
+}
+
+// splits `schema`.`table` or schema.table (or just a table name) at the dot which is not quoted, and unquotes both parts
+std::pair<std::string, std::string> split_table_name(const std::string& full_table_name) {
+	std::vector<std::string> parts(1);
+	bool quoted = false;
+	for (size_t i = 0; i < full_table_name.size(); ++i) {
+		char c = full_table_name[i];
+		if (c == '`') {
+			if (quoted && i + 1 < full_table_name.size() && full_table_name[i + 1] == '`') {
+				// a doubled backtick stands for itself within a quoted name
+				parts.back() += c;
+				++i;
+			} else {
+				quoted = !quoted;
+			}
+		} else if (c == '.' && !quoted) {
+			parts.emplace_back();
+		} else {
+			parts.back() += c;
+		}
+	}
+	if (quoted || parts.size() > 2) {
+		throw std::runtime_error("invalid table name " + full_table_name);
+	}
+	if (parts.size() == 1) {
+		return {std::string(), parts.front()};
+	}
+	return {parts.front(), parts.back()};
+}
+
+TableMetadata extract_table_metadata(Connection& conn, const std::string& full_table_name) {
+	// the current database is used if none is given
+	auto [schema, table] = split_table_name(full_table_name);
+
+	Query query = conn.query();
+	query << "SELECT c.COLUMN_NAME AS name, c.DATA_TYPE AS data_type, c.COLUMN_TYPE AS column_type,"
+	         " c.IS_NULLABLE AS nullable, c.EXTRA AS extra, s.SEQ_IN_INDEX AS key_ordinal"
+	         " FROM information_schema.COLUMNS c LEFT JOIN information_schema.STATISTICS s"
+	         " ON s.TABLE_SCHEMA=c.TABLE_SCHEMA AND s.TABLE_NAME=c.TABLE_NAME"
+	         " AND s.COLUMN_NAME=c.COLUMN_NAME AND s.INDEX_NAME='PRIMARY'"
+	         " WHERE c.TABLE_SCHEMA=";
+	if (schema.empty()) {
+		query << "DATABASE()";
+	} else {
+		query << mysqlpp::quote << schema;
+	}
+	query << " AND c.TABLE_NAME=" << mysqlpp::quote << table << " ORDER BY c.ORDINAL_POSITION";
+
+	std::vector<ColumnInfo> columns;
+	process_rows_from_query(conn, query, [&](const Row& row) {
+		std::string extra(row["extra"]);
+		if (extra.find("INVISIBLE") != std::string::npos) {
+			// not returned by SELECT *, so there is nothing to compare
+			return;
+		}
+		ColumnInfo column;
+		column.name = std::string(row["name"]);
+		column.data_type = std::string(row["data_type"]);
+		column.column_type = std::string(row["column_type"]);
+		column.kind = column_kind(column.data_type);
+		column.is_unsigned = column.column_type.find("unsigned") != std::string::npos;
+		column.is_nullable = (row["nullable"] == "YES");
+		// "DEFAULT_GENERATED" only means a default expression, so the space matters
+		column.is_generated = extra.find(" GENERATED") != std::string::npos || extra.find("PERSISTENT") != std::string::npos;
+		if (!row["key_ordinal"].is_null()) {
+			column.key_ordinal = std::stoi(std::string(row["key_ordinal"]));
+		}
+		columns.push_back(std::move(column));
 	});
-	return table_data;
+	if (columns.empty()) {
+		throw std::runtime_error("table " + full_table_name + " does not exist");
+	}
+	return TableMetadata(std::move(columns));
 }
 
-void print_delete(Connection& conn, const TableMetadata& metadata, const Row& row, const std::string& target_table_name) {
-	Query delete_query = conn.query();
-	delete_query << "DELETE FROM " + target_table_name + " WHERE ";
-	if (!metadata.output_equal_list_for_where(delete_query, row)) {
-		return;
+template<class RESULT, class INDEX>
+void fetch_table_data(Connection& conn, const TableMetadata& metadata, TableData<INDEX>& table_data) {
+	PackedKey keys;
+	process_raw_rows_from_query<RESULT>(conn, "SELECT * FROM " + table_data.full_table_name, [&](const auto& row) {
+		if (table_data.field_formats.empty()) {
+			for (int index = 0; index < metadata.field_count; ++index) {
+				table_data.field_formats.push_back({row.type(index), field_encoding(row, index)});
+			}
+		}
+		metadata.pack_keys(row, keys);
+		if (table_data.digest_only) {
+			table_data.rows.insert(metadata, row, table_data.arena.store(keys, metadata.digest_non_keys(row)));
+		} else {
+			table_data.rows.insert(metadata, row, table_data.arena.store(keys, row, metadata.field_count));
+		}
+	});
+	table_data.rows.finish_inserting();
+}
+
+// the letter to put after a backslash for characters which cannot appear verbatim in a string literal, or 0
+inline char escaped_form(char c) {
+	switch (c) {
+	case '\0': return '0';
+	case '\n': return 'n';
+	case '\r': return 'r';
+	case '\x1a': return 'Z';
+	case '\\': case '\'': case '"': return c;
+	default: return 0;
 	}
+}
 
-	std::cout << delete_query << ";\n";
+#ifdef __SSE2__
+// bitmask of bytes which have to be escaped, out of the 16 starting at data
+inline unsigned escape_mask(const char* data) {
+	__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+	__m128i special = _mm_cmpeq_epi8(chunk, _mm_setzero_si128());
+	for (char c : {'\n', '\r', '\x1a', '\\', '\'', '"'}) {
+		special = _mm_or_si128(special, _mm_cmpeq_epi8(chunk, _mm_set1_epi8(c)));
+	}
+	return static_cast<unsigned>(_mm_movemask_epi8(special));
+}
+#endif
+
+#ifdef __AVX2__
+// the same, but for 32 bytes
+inline unsigned escape_mask_wide(const char* data) {
+	__m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+	__m256i special = _mm256_cmpeq_epi8(chunk, _mm256_setzero_si256());
+	for (char c : {'\n', '\r', '\x1a', '\\', '\'', '"'}) {
+		special = _mm256_or_si256(special, _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(c)));
+	}
+	return static_cast<unsigned>(_mm256_movemask_epi8(special));
+}
+#endif
+
+// appends a quoted string literal, escaped the same way as mysql_real_escape_string does it;
+// all escaped characters are ASCII, so this is safe for any charset in which bytes below 0x80 are always characters
+inline void append_string_literal(std::string& out, const char* data, size_t length) {
+	size_t start = out.size();
+	out.resize(start + 2 * length + 2);
+	char* to = &out[start];
+	*to++ = '\'';
+	size_t i = 0;
+	auto escape = [&](char c) {
+		*to++ = '\\';
+		*to++ = escaped_form(c);
+	};
+	// runs of bytes which need no escaping are copied at once
+#ifdef __AVX2__
+	while (i + 32 <= length) {
+		unsigned mask = escape_mask_wide(data + i);
+		if (!mask) {
+			std::memcpy(to, data + i, 32);
+			to += 32;
+			i += 32;
+			continue;
+		}
+		auto clean = static_cast<size_t>(__builtin_ctz(mask));
+		std::memcpy(to, data + i, clean);
+		to += clean;
+		i += clean;
+		escape(data[i++]);
+	}
+#endif
+#ifdef __SSE2__
+	while (i + 16 <= length) {
+		unsigned mask = escape_mask(data + i);
+		if (!mask) {
+			std::memcpy(to, data + i, 16);
+			to += 16;
+			i += 16;
+			continue;
+		}
+		auto clean = static_cast<size_t>(__builtin_ctz(mask));
+		std::memcpy(to, data + i, clean);
+		to += clean;
+		i += clean;
+		escape(data[i++]);
+	}
+#endif
+	for (; i < length; ++i) {
+		if (escaped_form(data[i])) {
+			escape(data[i]);
+		} else {
+			*to++ = data[i];
+		}
+	}
+	*to++ = '\'';
+	out.resize(to - out.data());
+}
+
+// appends a hexadecimal literal, which needs no escaping at all
+inline void append_hex_literal(std::string& out, const char* data, size_t length) {
+	static const char digits[] = "0123456789abcdef";
+	size_t start = out.size();
+	out.resize(start + 2 * length + 3);
+	char* to = &out[start];
+	*to++ = 'X';
+	*to++ = '\'';
+	for (size_t i = 0; i < length; ++i) {
+		auto byte = static_cast<unsigned char>(data[i]);
+		*to++ = digits[byte >> 4];
+		*to++ = digits[byte & 15];
+	}
+	*to = '\'';
 }
 
-void print_insert(Connection& conn, const TableMetadata& metadata, const Row& row, const std::string& target_table_name) {
-	Query insert_query = conn.query();
-	insert_query << "INSERT INTO " + target_table_name + " (";
-	if (!metadata.output_field_list_for_insert(insert_query, row)) {
+// appends a field in the default format of LOAD DATA, i.e. tab-separated with backslash escapes
+inline void append_tsv_field(std::string& out, const FieldView& value) {
+	if (value.is_null) {
+		out += "\\N";
 		return;
 	}
-	insert_query << ") VALUES (";
-	if (!metadata.output_value_list_for_insert(insert_query, row)) {
+	for (size_t i = 0; i < value.length; ++i) {
+		char c = value.data[i];
+		switch (c) {
+		case '\0': out += "\\0"; break;
+		case '\t': out += "\\t"; break;
+		case '\n': out += "\\n"; break;
+		case '\r': out += "\\r"; break;
+		case '\\': out += "\\\\"; break;
+		default: out += c; break;
+		}
+	}
+}
+
+// multibyte charsets in which a backslash or a quote can be the second byte of a character
+inline bool is_escape_unsafe_charset(const std::string& charset) {
+	for (const char* unsafe : {"big5", "cp932", "gb18030", "gbk", "sjis"}) {
+		if (charset == unsafe) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// writes INSERT, UPDATE and DELETE statements for a single table; all the parts that do not depend
+// on the values are prepared upfront, and statements are collected in a buffer reused between them
+class StatementEmitter {
+	static constexpr size_t FLUSH_SIZE = 1 << 20;
+	// shorter runs of consecutive integer keys are simply listed
+	static constexpr uint64_t MIN_RANGE_LENGTH = 3;
+	// total length of keys in grouped UPDATEs, after which all of them are written out
+	static constexpr size_t MAX_PENDING_UPDATES = 64 << 20;
+	// memory taken by rows held back in the ordered mode, after which they are sorted and written out;
+	// there may be that much for each chunk being processed with --jobs
+	static constexpr size_t MAX_HELD_ROWS = 64 << 20;
+	// estimated memory taken by a held value apart from its bytes, i.e. the String and its shared buffer
+	static constexpr size_t HELD_VALUE_OVERHEAD = sizeof(String) + 64;
+
+	// keys of rows getting the same new values
+	struct UpdateGroup {
+		std::string keys;
+		size_t rows = 0;
+		// the part of pending_update_bytes added for this group
+		size_t bytes = 0;
+	};
+
+	enum Operation {
+		INSERTS, UPDATES, DELETES
+	};
+
+	// in the ordered mode, rows are held back until they can be sorted
+	struct HeldRow {
+		std::vector<String> values;
+		std::vector<int> changed_indexes;
+	};
+
+	struct Partition {
+		std::unique_ptr<StatementEmitter> emitter;
+		std::mutex mutex;
+	};
+
+	// in the staging mode, rows are written to these files instead of becoming statements
+	struct StagingFile {
+		std::string path;
+		std::ofstream stream;
+		std::string buffer;
+	};
+
+	const TableMetadata& metadata;
+	std::ostream& out;
+	// values arrive in the charset of the connection, and the statements are written in it as well;
+	// if it is not safe to escape, the introducer keeps hexadecimal literals of text in that charset
+	const std::string charset;
+	const bool hex_literals;
+	std::string insert_prefix;
+	// ON DUPLICATE KEY UPDATE clause in the upsert mode, or empty
+	std::string insert_suffix;
+	std::string update_prefix;
+	std::string delete_prefix;
+	std::vector<std::string> assignments;
+	std::vector<std::string> key_conditions;
+	std::string buffer;
+	// maximum length of a multi-row INSERT or DELETE, or 0 if each row should get its own statement
+	size_t batch_limit = 0;
+	size_t batch_rows = 0;
+	size_t batch_size = 0;
+	// position in the buffer where the multi-row INSERT still open (if any) starts
+	size_t open_insert = 0;
+	// e.g. "`id` IN (" or "(`a`,`b`) IN ("
+	std::string key_list_prefix;
+	std::string key_item;
+	// DELETE ... WHERE key IN (...), with the list of keys collected separately
+	std::string delete_list_prefix;
+	std::string delete_list;
+	size_t delete_rows = 0;
+	// for a single integer key, the current run of consecutive keys to be deleted
+	const int integer_key;
+	std::string delete_range_prefix;
+	uint64_t run_first = 0;
+	uint64_t run_length = 0;
+	// UPDATEs grouped by their SET clauses
+	std::map<std::string, UpdateGroup> update_groups;
+	std::string update_assignments;
+	size_t pending_update_bytes = 0;
+	bool staging = false;
+	std::array<StagingFile, 3> staging_files;
+	bool ordered = false;
+	std::array<std::vector<HeldRow>, 3> held_rows;
+	size_t held_bytes = 0;
+	// in the partitioned mode, rows are passed on to the emitters of their partitions, shared with all forks
+	std::shared_ptr<std::deque<Partition>> partitions;
+	bool owns_partitions = false;
+	PackedKey partition_key;
+
+	static std::string quote_name(const std::string& name) {
+		return "`" + name + "`";
+	}
+
+	void append_literal(std::string& to, const FieldView& value, int index) const {
+		if (metadata.column(index).is_numeric()) {
+			// numbers come from the server already formatted as valid literals
+			to.append(value.data, value.length);
+			return;
+		}
+		if (hex_literals) {
+			ColumnKind kind = metadata.column(index).kind;
+			if (kind != ColumnKind::BINARY && kind != ColumnKind::BIT) {
+				to += '_';
+				to += charset;
+			}
+			append_hex_literal(to, value.data, value.length);
+		} else {
+			append_string_literal(to, value.data, value.length);
+		}
+	}
+
+	template <class ROW>
+	void append_value(std::string& to, const ROW& row, int index) const {
+		FieldView value = field_view(row, index);
+		if (value.is_null) {
+			to += "NULL";
+		} else if (field_encoding(row, index) != FieldEncoding::TEXT) {
+			// binary values have to be formatted first
+			const String text = field_string(row, index);
+			append_literal(to, view_of(text), index);
+		} else {
+			append_literal(to, value, index);
+		}
+	}
+
+	template <class ROW>
+	void stage_row(Operation kind, const ROW& row, const std::list<int>& indexes) {
+		StagingFile& file = staging_files[kind];
+		bool first = true;
+		for (int index : indexes) {
+			if (!first) {
+				file.buffer += '\t';
+			}
+			if (field_encoding(row, index) != FieldEncoding::TEXT && !field_view(row, index).is_null) {
+				const String text = field_string(row, index);
+				append_tsv_field(file.buffer, view_of(text));
+			} else {
+				append_tsv_field(file.buffer, field_view(row, index));
+			}
+			first = false;
+		}
+		file.buffer += '\n';
+		if (file.buffer.size() >= FLUSH_SIZE) {
+			file.stream.write(file.buffer.data(), static_cast<std::streamsize>(file.buffer.size()));
+			file.buffer.clear();
+		}
+	}
+
+	// keys of a row as an element of the list after key_list_prefix
+	template <class ROW>
+	void make_key_item(const ROW& row) {
+		key_item.clear();
+		const bool composite = metadata.primary_keys().size() > 1;
+		if (composite) {
+			key_item += '(';
+		}
+		bool first = true;
+		for (int index : metadata.primary_keys()) {
+			if (!first) {
+				key_item += ',';
+			}
+			append_value(key_item, row, index);
+			first = false;
+		}
+		if (composite) {
+			key_item += ')';
+		}
+	}
+
+	template <class ROW>
+	void append_key_conditions(const ROW& row) {
+		auto condition = key_conditions.begin();
+		for (int index : metadata.primary_keys()) {
+			buffer += *condition++;
+			append_value(buffer, row, index);
+		}
+	}
+
+	// only complete statements are written, so that the output can be shared by a few emitters
+	void write_buffer(size_t length) {
+		out.write(buffer.data(), static_cast<std::streamsize>(length));
+		buffer.erase(0, length);
+	}
+
+	void write_buffer() {
+		write_buffer(buffer.size());
+	}
+
+	void finish_statement() {
+		buffer += ";\n";
+		if (buffer.size() >= FLUSH_SIZE) {
+			write_buffer();
+		}
+	}
+
+	void finish_inserts() {
+		if (batch_rows > 0) {
+			batch_rows = 0;
+			buffer += insert_suffix;
+			finish_statement();
+		}
+	}
+
+	void finish_delete_list() {
+		if (delete_rows > 0) {
+			buffer += delete_list_prefix;
+			buffer += delete_list;
+			buffer += ')';
+			delete_list.clear();
+			delete_rows = 0;
+			finish_statement();
+		}
+	}
+
+	void add_to_delete_list(const std::string& keys) {
+		if (delete_rows > 0 && delete_list_prefix.size() + delete_list.size() + 1 + keys.size() + 2 > batch_limit) {
+			finish_delete_list();
+		}
+		if (delete_rows > 0) {
+			delete_list += ',';
+		}
+		delete_list += keys;
+		++delete_rows;
+	}
+
+	void finish_run() {
+		// there are no runs for other keys, and integer_key is -1 then
+		if (integer_key < 0 || run_length == 0) {
+			return;
+		}
+		const bool is_unsigned = metadata.is_unsigned(integer_key);
+		if (run_length >= MIN_RANGE_LENGTH) {
+			buffer += delete_range_prefix;
+			buffer += ordered_integer_literal(run_first, is_unsigned);
+			buffer += " AND ";
+			buffer += ordered_integer_literal(run_first + run_length - 1, is_unsigned);
+			finish_statement();
+		} else {
+			for (uint64_t i = 0; i < run_length; ++i) {
+				add_to_delete_list(ordered_integer_literal(run_first + i, is_unsigned));
+			}
+		}
+		run_length = 0;
+	}
+
+	void finish_deletes() {
+		finish_run();
+		finish_delete_list();
+	}
+
+	void write_update_group(const std::string& assignments, UpdateGroup& group) {
+		// a multi-row INSERT may still be open in the buffer
+		finish_inserts();
+		buffer += update_prefix;
+		buffer += assignments;
+		buffer += " WHERE ";
+		buffer += key_list_prefix;
+		buffer += group.keys;
+		buffer += ')';
+		finish_statement();
+		group.keys.clear();
+		group.rows = 0;
+	}
+
+	void finish_updates() {
+		for (auto& [assignments, group] : update_groups) {
+			write_update_group(assignments, group);
+		}
+		update_groups.clear();
+		pending_update_bytes = 0;
+	}
+
+	void finish_pending() {
+		finish_inserts();
+		finish_deletes();
+		finish_updates();
+	}
+
+public:
+	StatementEmitter(Connection& conn, const TableMetadata& metadata, const std::string& target_table_name,
+	                 std::ostream& out = std::cout)
+		: metadata(metadata), out(out),
+		  charset(mysql_character_set_name(conn.driver()->raw_handle())), hex_literals(is_escape_unsafe_charset(charset)),
+		  assignments(metadata.field_count), integer_key(metadata.single_integer_key()) {
+		insert_prefix = "INSERT INTO " + target_table_name + " (";
+		bool first = true;
+		for (int index : metadata.writable_fields()) {
+			insert_prefix += (first ? "" : ",") + quote_name(metadata.column(index).name);
+			first = false;
+		}
+		insert_prefix += ") VALUES ";
+		update_prefix = "UPDATE " + target_table_name + " SET ";
+		delete_prefix = "DELETE FROM " + target_table_name + " WHERE ";
+		for (int index = 0; index < metadata.field_count; ++index) {
+			assignments[index] = quote_name(metadata.column(index).name) + "=";
+		}
+		for (int index : metadata.primary_keys()) {
+			key_conditions.push_back((key_conditions.empty() ? "" : " AND ") + assignments[index]);
+		}
+
+		// row constructors are needed for composite keys, e.g. (`a`,`b`) IN ((1,2),(3,4))
+		std::string key_list;
+		for (int index : metadata.primary_keys()) {
+			key_list += (key_list.empty() ? "" : ",") + quote_name(metadata.column(index).name);
+		}
+		if (metadata.primary_keys().size() > 1) {
+			key_list = "(" + key_list + ")";
+		}
+		key_list_prefix = key_list + " IN (";
+		delete_list_prefix = delete_prefix + key_list_prefix;
+		delete_range_prefix = delete_prefix + key_list + " BETWEEN ";
+	}
+
+	// the same statements, but written to another stream, e.g. for a chunk of rows processed in parallel
+	StatementEmitter(const StatementEmitter& prototype, std::ostream& out)
+		: metadata(prototype.metadata), out(out), charset(prototype.charset), hex_literals(prototype.hex_literals),
+		  insert_prefix(prototype.insert_prefix), insert_suffix(prototype.insert_suffix),
+		  update_prefix(prototype.update_prefix), delete_prefix(prototype.delete_prefix),
+		  assignments(prototype.assignments), key_conditions(prototype.key_conditions),
+		  batch_limit(prototype.batch_limit), key_list_prefix(prototype.key_list_prefix),
+		  delete_list_prefix(prototype.delete_list_prefix), integer_key(prototype.integer_key),
+		  delete_range_prefix(prototype.delete_range_prefix), ordered(prototype.ordered),
+		  partitions(prototype.partitions) { }
+
+	~StatementEmitter() {
+		try {
+			finish();
+		}
+		catch (...) {
+			// errors are reported only if finish() is called explicitly
+		}
+	}
+
+	StatementEmitter(const StatementEmitter&) = delete;
+	StatementEmitter& operator=(const StatementEmitter&) = delete;
+
+	// consecutive INSERTs and DELETEs, as well as all UPDATEs setting the same values,
+	// are merged into multi-row statements of at most that many bytes
+	void set_batch_limit(size_t limit) {
+		batch_limit = limit;
+	}
+
+	// new and changed rows are both written as INSERT ... ON DUPLICATE KEY UPDATE, so that they can be batched together;
+	// VALUES() is deprecated since MySQL 8.0.20, but the row alias syntax replacing it is not supported by MariaDB
+	void set_upsert() {
+		const std::list<int>& columns = metadata.non_primary_keys().empty()
+			? metadata.primary_keys() : metadata.non_primary_keys();
+		insert_suffix = " ON DUPLICATE KEY UPDATE ";
+		bool first = true;
+		for (int index : columns) {
+			std::string name = quote_name(metadata.column(index).name);
+			insert_suffix += (first ? "" : ",") + name + "=VALUES(" + name + ")";
+			first = false;
+		}
+	}
+
+	// rows are written to TSV files in the given directory, and the statements become a script loading them into
+	// temporary tables with LOAD DATA LOCAL INFILE, and applying them all at once with joins
+	void set_staging(const std::string& directory, const std::string& target_table_name) {
+		// in these charsets a 0x5C byte may be the second byte of a character, which LOAD DATA reads as a whole,
+		// so escaping it with a backslash would corrupt the data
+		if (hex_literals) {
+			throw std::runtime_error("--staging cannot be used with the " + charset + " connection charset");
+		}
+		staging = true;
+		const char* names[] = {"inserts", "updates", "deletes"};
+		for (int kind = 0; kind < 3; ++kind) {
+			StagingFile& file = staging_files[kind];
+			// the script may be run from anywhere
+			file.path = (std::filesystem::absolute(directory) / (std::string(names[kind]) + ".tsv")).string();
+			file.stream.open(file.path, std::ios::binary | std::ios::trunc);
+			if (!file.stream) {
+				throw std::runtime_error("cannot create " + file.path);
+			}
+		}
+
+		auto list = [&](const std::list<int>& indexes) {
+			std::string result;
+			for (int index : indexes) {
+				result += (result.empty() ? "" : ",") + quote_name(metadata.column(index).name);
+			}
+			return result;
+		};
+		const std::string fields = list(metadata.writable_fields());
+		const std::string keys = list(metadata.primary_keys());
+		std::string updated_fields;
+		for (int index : metadata.non_primary_keys()) {
+			std::string name = quote_name(metadata.column(index).name);
+			updated_fields += (updated_fields.empty() ? "t." : ",t.") + name + "=s." + name;
+		}
+		auto load = [&](Operation kind, const std::string& table, const std::string& columns) {
+			buffer += "LOAD DATA LOCAL INFILE ";
+			append_string_literal(buffer, staging_files[kind].path.data(), staging_files[kind].path.size());
+			buffer += " INTO TABLE " + table + " CHARACTER SET " + charset + " (" + columns + ");\n";
+		};
+
+		buffer += "CREATE TEMPORARY TABLE `dbdpp_inserts` LIKE " + target_table_name + ";\n";
+		buffer += "CREATE TEMPORARY TABLE `dbdpp_updates` LIKE " + target_table_name + ";\n";
+		// only the keys are needed, so other columns (and their NOT NULL constraints) are left out
+		buffer += "CREATE TEMPORARY TABLE `dbdpp_deletes` SELECT " + keys + " FROM " + target_table_name + " LIMIT 0;\n";
+		load(INSERTS, "`dbdpp_inserts`", fields);
+		load(UPDATES, "`dbdpp_updates`", fields);
+		load(DELETES, "`dbdpp_deletes`", keys);
+		buffer += "DELETE t FROM " + target_table_name + " t JOIN `dbdpp_deletes` USING (" + keys + ");\n";
+		if (!metadata.non_primary_keys().empty()) {
+			buffer += "UPDATE " + target_table_name + " t JOIN `dbdpp_updates` s USING (" + keys + ") SET "
+				+ updated_fields + ";\n";
+		}
+		buffer += "INSERT INTO " + target_table_name + " (" + fields + ") SELECT " + fields + " FROM `dbdpp_inserts`;\n";
+		buffer += "DROP TEMPORARY TABLE `dbdpp_inserts`, `dbdpp_updates`, `dbdpp_deletes`;\n";
+	}
+
+	// statements are grouped by their kind, and sorted by primary keys (integer ones numerically,
+	// other ones bytewise) within each group, so that the target can apply them sequentially;
+	// only a bounded amount of rows is held back, so for large diffs there is a series of such groups
+	void set_ordered() {
+		ordered = true;
+	}
+
+	// rows are spread over emitters writing to the given streams by the hash of their primary keys, so that the streams
+	// can be applied independently of each other; the emitters are forks of this one, so it has to be set up already
+	void set_partitions(const std::vector<std::ostream*>& streams) {
+		// the emitters are created before the partitions are set, so that they do not pass the rows on themselves
+		auto created = std::make_shared<std::deque<Partition>>();
+		for (std::ostream* stream : streams) {
+			created->emplace_back().emitter = std::make_unique<StatementEmitter>(*this, *stream);
+		}
+		partitions = std::move(created);
+		owns_partitions = true;
+	}
+
+	// completes the pending statement, if any, and writes out everything
+	void finish() {
+		if (owns_partitions) {
+			for (Partition& partition : *partitions) {
+				std::lock_guard<std::mutex> lock(partition.mutex);
+				partition.emitter->finish();
+			}
+		}
+		release_held_rows();
+		finish_pending();
+		write_buffer();
+		for (StagingFile& file : staging_files) {
+			if (file.stream.is_open()) {
+				file.stream.write(file.buffer.data(), static_cast<std::streamsize>(file.buffer.size()));
+				file.buffer.clear();
+				file.stream.flush();
+				if (!file.stream) {
+					throw std::runtime_error("cannot write " + file.path);
+				}
+			}
+		}
+	}
+
+private:
+	template <class ROW>
+	void write_insert(const ROW& row) {
+		if (metadata.writable_fields().empty()) {
+			return;
+		}
+		if (staging) {
+			stage_row(INSERTS, row, metadata.writable_fields());
+			return;
+		}
+		finish_deletes();
+		size_t separator = buffer.size();
+		if (batch_rows > 0) {
+			buffer += ',';
+		} else {
+			open_insert = separator;
+			buffer += insert_prefix;
+		}
+		size_t row_start = buffer.size();
+		buffer += '(';
+		bool first = true;
+		for (int index : metadata.writable_fields()) {
+			if (!first) {
+				buffer += ',';
+			}
+			append_value(buffer, row, index);
+			first = false;
+		}
+		buffer += ')';
+		if (!batch_limit) {
+			buffer += insert_suffix;
+			finish_statement();
+			return;
+		}
+
+		size_t row_size = buffer.size() - row_start;
+		if (batch_rows > 0 && batch_size + 1 + row_size + insert_suffix.size() + 1 > batch_limit) {
+			// the row does not fit anymore, so it starts a new statement instead
+			buffer.replace(separator, 1, insert_suffix + ";\n" + insert_prefix);
+			open_insert = separator + insert_suffix.size() + 2;
+			batch_rows = 0;
+		}
+		batch_size = (batch_rows > 0) ? batch_size + 1 + row_size : insert_prefix.size() + row_size;
+		++batch_rows;
+		if (buffer.size() >= FLUSH_SIZE) {
+			// the open statement stays in the buffer, as more rows may still be added to it
+			write_buffer(open_insert);
+			open_insert = 0;
+		}
+	}
+
+	template <class ROW>
+	void write_update(const ROW& row, const std::vector<int>& changed_indexes) {
+		if (changed_indexes.empty() || key_conditions.empty()) {
+			return;
+		}
+		if (staging) {
+			stage_row(UPDATES, row, metadata.writable_fields());
+			return;
+		}
+		if (!insert_suffix.empty()) {
+			write_insert(row);
+			return;
+		}
+		if (!batch_limit) {
+			buffer += update_prefix;
+			bool first = true;
+			for (int index : changed_indexes) {
+				if (!first) {
+					buffer += ',';
+				}
+				buffer += assignments[index];
+				append_value(buffer, row, index);
+				first = false;
+			}
+			buffer += " WHERE ";
+			append_key_conditions(row);
+			finish_statement();
+			return;
+		}
+
+		// rows getting the same new values are updated together, whenever the group gets written out;
+		// this is safe, as all statements are about different primary keys
+		update_assignments.clear();
+		bool first = true;
+		for (int index : changed_indexes) {
+			if (!first) {
+				update_assignments += ',';
+			}
+			update_assignments += assignments[index];
+			append_value(update_assignments, row, index);
+			first = false;
+		}
+		make_key_item(row);
+		auto it = update_groups.find(update_assignments);
+		if (it != update_groups.end()) {
+			size_t statement_size = update_prefix.size() + update_assignments.size() + 7 + key_list_prefix.size()
+				+ it->second.keys.size() + 1 + key_item.size() + 1;
+			if (statement_size > batch_limit) {
+				// the group is written out and dropped, so everything it was counted with is subtracted
+				pending_update_bytes -= it->second.bytes;
+				write_update_group(it->first, it->second);
+				update_groups.erase(it);
+				it = update_groups.end();
+			}
+		}
+		if (it == update_groups.end()) {
+			it = update_groups.emplace(update_assignments, UpdateGroup()).first;
+			it->second.bytes = update_assignments.size();
+			pending_update_bytes += update_assignments.size();
+		}
+		UpdateGroup& group = it->second;
+		if (group.rows > 0) {
+			group.keys += ',';
+		}
+		group.keys += key_item;
+		++group.rows;
+		group.bytes += key_item.size() + 1;
+		pending_update_bytes += key_item.size() + 1;
+		if (pending_update_bytes > MAX_PENDING_UPDATES) {
+			finish_updates();
+		}
+	}
+
+	template <class ROW>
+	void write_delete(const ROW& row) {
+		if (key_conditions.empty()) {
+			return;
+		}
+		if (staging) {
+			stage_row(DELETES, row, metadata.primary_keys());
+			return;
+		}
+		finish_inserts();
+		if (!batch_limit) {
+			buffer += delete_prefix;
+			append_key_conditions(row);
+			finish_statement();
+			return;
+		}
+
+		if (integer_key >= 0) {
+			// runs of consecutive keys, e.g. of expired rows, become ranges
+			uint64_t key = ordered_integer(row, integer_key, metadata.is_unsigned(integer_key));
+			if (run_length > 0 && key == run_first + run_length) {
+				++run_length;
+				return;
+			}
+			finish_run();
+			run_first = key;
+			run_length = 1;
+			return;
+		}
+
+		make_key_item(row);
+		add_to_delete_list(key_item);
+	}
+
+	template <class ROW>
+	Partition& partition_of(const ROW& row) {
+		uint64_t hash;
+		if (integer_key >= 0) {
+			// blocks of consecutive keys stay together, so that runs of them can still be deleted as ranges
+			uint64_t block = ordered_integer(row, integer_key, metadata.is_unsigned(integer_key)) >> 10;
+			hash = hash_bytes(reinterpret_cast<const char*>(&block), sizeof(block));
+		} else {
+			metadata.pack_keys(row, partition_key);
+			hash = hash_bytes(partition_key.data(), partition_key.size());
+		}
+		return (*partitions)[hash % partitions->size()];
+	}
+
+	template <class ROW>
+	void hold(Operation operation, const ROW& row, const std::vector<int>& changed_indexes = {}) {
+		HeldRow held;
+		held.values.reserve(metadata.field_count);
+		for (int index = 0; index < metadata.field_count; ++index) {
+			held.values.push_back(field_string(row, index));
+			held_bytes += held.values.back().length() + HELD_VALUE_OVERHEAD;
+		}
+		held.changed_indexes = changed_indexes;
+		held_bytes += sizeof(HeldRow) + changed_indexes.size() * sizeof(int);
+		held_rows[operation].push_back(std::move(held));
+		if (held_bytes > MAX_HELD_ROWS) {
+			release_held_rows();
+		}
+	}
+
+	// DELETEs go first, so that they free unique values for the other statements
+	void release_held_rows() {
+		for (Operation operation : {DELETES, UPDATES, INSERTS}) {
+			std::vector<HeldRow>& rows = held_rows[operation];
+			std::sort(rows.begin(), rows.end(), [&](const HeldRow& x, const HeldRow& y) {
+				return metadata.compare_keys(x.values, y.values) < 0;
+			});
+			for (const HeldRow& row : rows) {
+				switch (operation) {
+				case INSERTS: write_insert(row.values); break;
+				case UPDATES: write_update(row.values, row.changed_indexes); break;
+				case DELETES: write_delete(row.values); break;
+				}
+			}
+			rows.clear();
+			// batched statements, and grouped UPDATEs in particular, must not be left for after the next group
+			finish_pending();
+		}
+		held_bytes = 0;
+	}
+
+public:
+	template <class ROW>
+	void emit_insert(const ROW& row) {
+		if (partitions) {
+			Partition& partition = partition_of(row);
+			std::lock_guard<std::mutex> lock(partition.mutex);
+			partition.emitter->emit_insert(row);
+		} else if (ordered) {
+			hold(INSERTS, row);
+		} else {
+			write_insert(row);
+		}
+	}
+
+	template <class ROW>
+	void emit_update(const ROW& row, const std::vector<int>& changed_indexes) {
+		if (partitions) {
+			Partition& partition = partition_of(row);
+			std::lock_guard<std::mutex> lock(partition.mutex);
+			partition.emitter->emit_update(row, changed_indexes);
+		} else if (ordered) {
+			hold(UPDATES, row, changed_indexes);
+		} else {
+			write_update(row, changed_indexes);
+		}
+	}
+
+	template <class ROW>
+	void emit_delete(const ROW& row) {
+		if (partitions) {
+			Partition& partition = partition_of(row);
+			std::lock_guard<std::mutex> lock(partition.mutex);
+			partition.emitter->emit_delete(row);
+		} else if (ordered) {
+			hold(DELETES, row);
+		} else {
+			write_delete(row);
+		}
+	}
+};
+
+bool equals(const FieldView& x, const FieldView& y) {
+	if (x.is_null || y.is_null) {
+		return x.is_null == y.is_null;
+	}
+	return x.length == y.length && std::memcmp(x.data, y.data, x.length) == 0;
+}
+
+bool equals(const String& x, const String& y) {
+	return equals(view_of(x), view_of(y));
+}
+
+template <class ROW1, class ROW2>
+bool differs(const TableMetadata& metadata, const ROW1& source_row, const ROW2& target_row, std::vector<int>& changed_indexes) {
+	changed_indexes.clear();
+	for (int index = 0; index < metadata.field_count; ++index) {
+		if (!metadata.is_generated(index) && !equals(field_view(source_row, index), field_view(target_row, index))) {
+			changed_indexes.push_back(index);
+		}
+	}
+	return !changed_indexes.empty();
+}
+
+template <class ROW>
+bool differs(const TableMetadata& metadata, const ROW& source_row, RowArena::StoredRow target_row, std::vector<int>& changed_indexes) {
+	changed_indexes.clear();
+	for (int index = 0; index < metadata.field_count; ++index) {
+		FieldView target_value = target_row.next();
+		if (!metadata.is_generated(index) && !equals(field_view(source_row, index), target_value)) {
+			changed_indexes.push_back(index);
+		}
+	}
+	return !changed_indexes.empty();
+}
+
+// fetches a single row from the table again, to find out which of its fields have changed
+template <class RESULT, class ROW>
+bool differs_from_refetched(Connection& conn, const TableMetadata& metadata, const ROW& source_row,
+                            const std::string& full_table_name, std::vector<int>& changed_indexes) {
+	Query select_query = conn.query();
+	select_query << "SELECT * FROM " + full_table_name + " WHERE ";
+	if (!metadata.output_equal_list_for_where(select_query, source_row)) {
+		return false;
+	}
+	bool changed = false;
+	process_raw_rows_from_query<RESULT>(conn, select_query.str(), [&](const auto& target_row) {
+		changed = differs(metadata, source_row, target_row, changed_indexes);
+	});
+	return changed;
+}
+
+template<class RESULT, class INDEX>
+void compute_table_diff(Connection& source_conn, Connection& target_conn, const TableMetadata& metadata,
+                        const std::string& full_table_name, TableData<INDEX>& table_data, StatementEmitter& emitter) {
+	std::vector<int> changed_indexes;
+	process_raw_rows_from_query<RESULT>(source_conn, "SELECT * FROM " + full_table_name, [&](const auto& row) {
+		RowArena::Ref* it = table_data.rows.find(metadata, row);
+		if (!it) {
+			// if the row is not present in table_data, it should be INSERTed
+			emitter.emit_insert(row);
+		}
+		else {
+			// it is present, but it may have changed
+			bool changed;
+			if (table_data.digest_only) {
+				changed = metadata.digest_non_keys(row) != table_data.arena.digest(*it)
+					&& differs_from_refetched<RESULT>(target_conn, metadata, row, table_data.full_table_name, changed_indexes);
+			} else {
+				changed = differs(metadata, row, table_data.arena.row(*it, metadata.field_count), changed_indexes);
+			}
+			if (changed) {
+				emitter.emit_update(row, changed_indexes);
+			}
+			table_data.rows.erase(it);
+		}
+	});
+
+	// afterwards, all rows that are left in table_data are the ones that should be DELETEd
+	std::vector<String> old_row;
+	table_data.rows.for_each([&](RowArena::Ref old) {
+		if (table_data.digest_only) {
+			metadata.unpack_keys(table_data.arena.key(old), table_data.field_formats, old_row);
+		} else {
+			table_data.arena.materialize(old, table_data.field_formats, old_row);
+		}
+		emitter.emit_delete(old_row);
+	});
+}
+
+template<class RESULT, class INDEX>
+void compute_table_diff_in_memory(Connection& source_conn, Connection& target_conn, const TableMetadata& metadata,
+                                  const std::string& source_table_name, const std::string& target_table_name,
+                                  bool digest_only, StatementEmitter& emitter) {
+	TableData<INDEX> data_in_target(target_table_name, digest_only, metadata);
+	fetch_table_data<RESULT>(target_conn, metadata, data_in_target);
+	compute_table_diff<RESULT>(source_conn, target_conn, metadata, source_table_name, data_in_target, emitter);
+}
+
+template<class RESULT>
+void compute_table_diff_in_memory(Connection& source_conn, Connection& target_conn, const TableMetadata& metadata,
+                                  const std::string& source_table_name, const std::string& target_table_name,
+                                  bool digest_only, StatementEmitter& emitter) {
+	// tables with a single integer primary key are the most common, so they get a specialized index
+	if (metadata.single_integer_key() >= 0) {
+		compute_table_diff_in_memory<RESULT, IntegerKeyIndex>(source_conn, target_conn, metadata,
+		                                                      source_table_name, target_table_name, digest_only, emitter);
+	} else {
+		compute_table_diff_in_memory<RESULT, PackedKeyIndex>(source_conn, target_conn, metadata,
+		                                                     source_table_name, target_table_name, digest_only, emitter);
+	}
+}
+
+// range of primary keys from lower (inclusive) to upper (exclusive); empty rows stand for no bound
+struct KeyRange {
+	Row lower;
+	Row upper;
+};
+
+std::string select_ordered_by_keys(Connection& conn, const TableMetadata& metadata, const std::string& full_table_name,
+                             const KeyRange& range = {}) {
+	Query select_query = conn.query();
+	select_query << "SELECT * FROM " + full_table_name + " WHERE ";
+	metadata.output_key_range_for_where(select_query, range.lower, range.upper);
+	select_query << " ORDER BY ";
+	metadata.output_key_list_for_order_by(select_query, {});
+	return select_query.str();
+}
+
+// generates statements for two streams of rows, both ordered by primary keys
+void merge_rows(const TableMetadata& metadata, RowStream& source, RowStream& target, StatementEmitter& emitter) {
+	std::vector<int> changed_indexes;
+	while (!source.finished() || !target.finished()) {
+		int comparison = source.finished() ? 1 : target.finished() ? -1 : metadata.compare_keys(source.row(), target.row());
+		if (comparison < 0) {
+			// the row is present only in source, so it should be INSERTed
+			emitter.emit_insert(source.row());
+			source.advance();
+		}
+		else if (comparison > 0) {
+			// the row is present only in target, so it should be DELETEd
+			emitter.emit_delete(target.row());
+			target.advance();
+		}
+		else {
+			// it is present in both, but it may have changed
+			if (differs(metadata, source.row(), target.row(), changed_indexes)) {
+				emitter.emit_update(source.row(), changed_indexes);
+			}
+			source.advance();
+			target.advance();
+		}
+	}
+}
+
+void compute_table_diff_merge(Connection& source_conn, Connection& target_conn, const TableMetadata& metadata,
+                              const std::string& source_table_name, const std::string& target_table_name,
+                              StatementEmitter& emitter) {
+	// both tables are read in primary key order at the same time, so only the current rows are kept in memory
+	RowStream source(metadata, source_conn, select_ordered_by_keys(source_conn, metadata, source_table_name));
+	RowStream target(metadata, target_conn, select_ordered_by_keys(target_conn, metadata, target_table_name));
+	merge_rows(metadata, source, target, emitter);
+}
+
+struct RangeChecksum {
+	unsigned long long row_count = 0;
+	std::string checksum;
+
+	bool operator==(const RangeChecksum& that) const {
+		return row_count == that.row_count && checksum == that.checksum;
+	}
+};
+
+RangeChecksum checksum_range(Connection& conn, const TableMetadata& metadata, const std::string& full_table_name,
+                             const KeyRange& range) {
+	Query select_query = conn.query();
+	select_query << "SELECT COUNT(*),";
+	metadata.output_checksum_for_select(select_query);
+	select_query << " FROM " + full_table_name + " WHERE ";
+	metadata.output_key_range_for_where(select_query, range.lower, range.upper);
+
+	RangeChecksum result;
+	process_rows_from_query(conn, select_query, [&](const Row& row) {
+		result.row_count = std::strtoull(row.at(0).c_str(), nullptr, 10);
+		row.at(1).to_string(result.checksum);
+	});
+	return result;
+}
+
+// finds the key splitting the given range into two parts, the lower one having the given number of rows
+Row select_split_key(Connection& conn, const TableMetadata& metadata, const std::string& full_table_name,
+                     const KeyRange& range, unsigned long long offset) {
+	Query select_query = conn.query();
+	select_query << "SELECT * FROM " + full_table_name + " WHERE ";
+	metadata.output_key_range_for_where(select_query, range.lower, range.upper);
+	// the order has to be consistent with range conditions, so here the server's own ordering is used
+	select_query << " ORDER BY ";
+	metadata.output_key_list_for_using(select_query, {});
+	select_query << " LIMIT 1 OFFSET " << offset;
+
+	Row split_key;
+	process_rows_from_query(conn, select_query, [&](const Row& row) {
+		split_key = row;
+	});
+	return split_key;
+}
+
+// rows are fetched only from ranges having at most that many rows, and different checksums on both sides
+constexpr unsigned long long CHECKSUM_LEAF_ROWS = 1000;
+
+void compute_range_diff_checksum(Connection& source_conn, Connection& target_conn, const TableMetadata& metadata,
+                                 const std::string& source_table_name, const std::string& target_table_name,
+                                 const KeyRange& range, StatementEmitter& emitter) {
+	RangeChecksum source_checksum = checksum_range(source_conn, metadata, source_table_name, range);
+	RangeChecksum target_checksum = checksum_range(target_conn, metadata, target_table_name, range);
+	if (source_checksum == target_checksum) {
 		return;
 	}
-	insert_query << ")";
 
-	std::cout << insert_query << ";\n";
+	const bool split_source = (source_checksum.row_count >= target_checksum.row_count);
+	const unsigned long long row_count = std::max(source_checksum.row_count, target_checksum.row_count);
+	if (row_count > CHECKSUM_LEAF_ROWS) {
+		Row split_key = split_source
+			? select_split_key(source_conn, metadata, source_table_name, range, row_count / 2)
+			: select_split_key(target_conn, metadata, target_table_name, range, row_count / 2);
+		if (split_key) {
+			compute_range_diff_checksum(source_conn, target_conn, metadata, source_table_name, target_table_name,
+			                            {range.lower, split_key}, emitter);
+			compute_range_diff_checksum(source_conn, target_conn, metadata, source_table_name, target_table_name,
+			                            {split_key, range.upper}, emitter);
+			return;
+		}
+	}
+
+	RowStream source(metadata, source_conn, select_ordered_by_keys(source_conn, metadata, source_table_name, range));
+	RowStream target(metadata, target_conn, select_ordered_by_keys(target_conn, metadata, target_table_name, range));
+	merge_rows(metadata, source, target, emitter);
+}
+
+void compute_table_diff_checksum(Connection& source_conn, Connection& target_conn, const TableMetadata& metadata,
+                                 const std::string& source_table_name, const std::string& target_table_name,
+                                 StatementEmitter& emitter) {
+	// ranges with identical checksums on both sides are skipped, other ones are split in half until they are small enough
+	compute_range_diff_checksum(source_conn, target_conn, metadata, source_table_name, target_table_name, {}, emitter);
+}
+
+// splits the source table into consecutive ranges of primary keys, having about CHUNK_ROWS rows each
+class ChunkSplitter {
+	static constexpr unsigned long long CHUNK_ROWS = 100000;
+
+	Connection& conn;
+	const TableMetadata& metadata;
+	const std::string& full_table_name;
+	Row lower;
+	size_t chunk_count = 0;
+	bool finished = false;
+
+public:
+	ChunkSplitter(Connection& conn, const TableMetadata& metadata, const std::string& full_table_name)
+		: conn(conn), metadata(metadata), full_table_name(full_table_name) { }
+
+	// the next range starts where the previous one ended, and ends at the key CHUNK_ROWS rows further,
+	// which the server finds with an OFFSET scan of these rows along the primary key
+	bool next(KeyRange& range, size_t& index) {
+		if (finished) {
+			return false;
+		}
+		Row upper = select_split_key(conn, metadata, full_table_name, {lower, Row()}, CHUNK_ROWS);
+		range = {lower, upper};
+		index = chunk_count++;
+		finished = !upper;
+		lower = upper;
+		return true;
+	}
+};
+
+// the longest statement that the server accepts, with some room left for the client protocol
+size_t max_statement_size(Connection& conn) {
+	static constexpr size_t RESERVE = 1024;
+	size_t max_allowed_packet = 0;
+	process_rows_from_query(conn, "SELECT @@max_allowed_packet", [&](const Row& row) {
+		max_allowed_packet = std::stoull(std::string(row.at(0)));
+	});
+	return std::max(max_allowed_packet, 2 * RESERVE) - RESERVE;
 }
 
-void print_update(Connection& conn, const TableMetadata& metadata, const Row& row, const std::string& target_table_name, const std::vector<int>& changed_indexes) {
-	Query update_query = conn.query();
-	update_query << "UPDATE " + target_table_name + " SET ";
-	if (!metadata.output_equal_list_for_update(update_query, row, changed_indexes)) {
-		return;
-	}
-	update_query << " WHERE ";
-	if (!metadata.output_equal_list_for_where(update_query, row)) {
-		return;
+std::shared_ptr<Connection> open_connection(const Config& config, bool multi_statements = false) {
+	auto conn = std::make_shared<Connection>();
+	if (multi_statements) {
+		conn->set_option(new mysqlpp::MultiStatementsOption(true));
 	}
-
-	std::cout << update_query << ";\n";
+	conn->connect(config.database.c_str(), config.host.c_str(), config.user.c_str(), config.password.c_str());
+	// rows are streamed with mysql_use_result, and a result may be left unread for a long time, e.g. while merging
+	// a long run of rows missing on the other side, or while the applier is behind; without this, the server
+	// would abort such a query after net_write_timeout (60 s by default)
+	conn->query().exec("SET SESSION net_write_timeout=86400");
+	return conn;
 }
 
-bool equals(const String& x, const String& y) {
-	return x.is_null() == y.is_null() && x == y;
-}
+void compute_table_diff_parallel(Connection& conn, const Config& source, const Config& target, const TableMetadata& metadata,
+                                 const std::string& source_table_name, const std::string& target_table_name, int jobs,
+                                 StatementEmitter& emitter) {
+	// at most that many chunks are processed or waiting to be printed at any time
+	const size_t max_pending = 2 * static_cast<size_t>(jobs);
 
-void compute_table_diff(Connection& conn, const TableMetadata& metadata, const std::string& full_table_name,
-                        TableData& table_data) {
-	std::vector<int> changed_indexes;
-	process_rows_from_query(conn, "SELECT * FROM " + full_table_name, [&](const Row& row) {
-		PrimaryKey keys = metadata.extract_keys(row);
+	// connections are opened upfront, as the client library does not like to be initialized concurrently
+	std::vector<std::pair<std::shared_ptr<Connection>, std::shared_ptr<Connection>>> connections;
+	for (int job = 0; job < jobs; ++job) {
+		connections.emplace_back(open_connection(source), open_connection(target));
+	}
 
-		auto it = table_data.rows.find(keys);
-		if (it == table_data.rows.end()) {
-			// if the row is not present in table_data, it should be INSERTed
-			print_insert(conn, metadata, row, table_data.full_table_name);
+	std::mutex mutex;
+	std::condition_variable condition;
+	// ranges found so far, but not taken by any worker yet
+	std::deque<std::pair<size_t, KeyRange>> ranges;
+	size_t range_count = 0;
+	bool split_done = false;
+	std::map<size_t, std::string> outputs;
+	size_t printed = 0;
+	std::exception_ptr error;
+
+	auto fail = [&] {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!error) {
+			error = std::current_exception();
 		}
-		else {
-			// it is present, but it may have changed
-			changed_indexes.clear();
-			for (int index = 0; index < metadata.field_count; ++index) {
-				if (!equals(row[index], it->second[index])) {
-					changed_indexes.push_back(index);
+		condition.notify_all();
+	};
+
+	// the ranges are found by a thread of its own on the given connection, so that the workers do not wait for
+	// each split query, but only for the ranges which are not found yet
+	auto split = [&] {
+		Connection::thread_start();
+		try {
+			ChunkSplitter splitter(conn, metadata, source_table_name);
+			while (true) {
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					condition.wait(lock, [&] { return error || range_count < printed + max_pending; });
+					if (error) {
+						break;
+					}
+				}
+				KeyRange range;
+				size_t index;
+				const bool found = splitter.next(range, index);
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!found) {
+					split_done = true;
+					condition.notify_all();
+					break;
 				}
+				ranges.emplace_back(index, std::move(range));
+				++range_count;
+				condition.notify_all();
 			}
-			if (!changed_indexes.empty()) {
-				print_update(conn, metadata, row, table_data.full_table_name, changed_indexes);
+		}
+		catch (...) {
+			fail();
+		}
+		Connection::thread_end();
+	};
+
+	auto worker = [&](Connection& source_conn, Connection& target_conn) {
+		Connection::thread_start();
+		try {
+			while (true) {
+				KeyRange range;
+				size_t index;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					condition.wait(lock, [&] { return error || !ranges.empty() || split_done; });
+					if (error || ranges.empty()) {
+						break;
+					}
+					index = ranges.front().first;
+					range = std::move(ranges.front().second);
+					ranges.pop_front();
+				}
+				RowStream source_rows(metadata, source_conn,
+				                      select_ordered_by_keys(source_conn, metadata, source_table_name, range));
+				RowStream target_rows(metadata, target_conn,
+				                      select_ordered_by_keys(target_conn, metadata, target_table_name, range));
+				std::ostringstream out;
+				{
+					StatementEmitter chunk_emitter(emitter, out);
+					merge_rows(metadata, source_rows, target_rows, chunk_emitter);
+					chunk_emitter.finish();
+				}
+
+				std::lock_guard<std::mutex> lock(mutex);
+				outputs.emplace(index, out.str());
+				condition.notify_all();
 			}
-			table_data.rows.erase(it);
 		}
-	});
+		catch (...) {
+			fail();
+		}
+		Connection::thread_end();
+	};
 
-	// afterwards, all rows that are left in table_data are the ones that should be DELETEd
-	for (const auto& old : table_data.rows) {
-		print_delete(conn, metadata, old.second, table_data.full_table_name);
+	std::vector<std::thread> threads;
+	threads.emplace_back(split);
+	for (auto& [source_conn, target_conn] : connections) {
+		threads.emplace_back(worker, std::ref(*source_conn), std::ref(*target_conn));
+	}
+
+	// outputs of the chunks are printed in order, as soon as they are available
+	while (true) {
+		std::string output;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			condition.wait(lock, [&] {
+				return error || outputs.count(printed) || (split_done && printed == range_count);
+			});
+			if (error || !outputs.count(printed)) {
+				break;
+			}
+			output = std::move(outputs[printed]);
+			outputs.erase(printed);
+		}
+		std::cout << output;
+		std::lock_guard<std::mutex> lock(mutex);
+		++printed;
+		condition.notify_all();
+	}
+
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+	if (error) {
+		std::rethrow_exception(error);
 	}
 }
 
-void compute_changed_rows_on_db(Connection& conn, const TableMetadata& metadata, const std::string& source_table_name, const std::string& target_table_name) {
+void compute_changed_rows_on_db(Connection& conn, const TableMetadata& metadata, const std::string& source_table_name, const std::string& target_table_name,
+                                StatementEmitter& emitter) {
 	Query select_query = conn.query();
 	select_query << "SELECT s.*, t.* FROM " + source_table_name + " s JOIN " + target_table_name + " t USING (";
 	if (!metadata.output_key_list_for_using(select_query, {})) {
@@ -403,17 +3006,18 @@ void compute_changed_rows_on_db(Connection& conn, const TableMetadata& metadata,
 		// the rows present in both database, but with different values
 		changed_indexes.clear();
 		for (int index = 0; index < metadata.field_count; ++index) {
-			if (!equals(row[index], row[index + metadata.field_count])) {
+			if (!metadata.is_generated(index) && !equals(row[index], row[index + metadata.field_count])) {
 				changed_indexes.push_back(index);
 			}
 		}
 		if (!changed_indexes.empty()) {
-			print_update(conn, metadata, row, target_table_name, changed_indexes);
+			emitter.emit_update(row, changed_indexes);
 		}
 	});
 }
 
-void compute_new_rows_on_db(Connection& conn, const TableMetadata& metadata, const std::string& source_table_name, const std::string& target_table_name) {
+void compute_new_rows_on_db(Connection& conn, const TableMetadata& metadata, const std::string& source_table_name, const std::string& target_table_name,
+                            StatementEmitter& emitter) {
 	Query select_query = conn.query();
 	select_query << "SELECT s.* FROM " + source_table_name + " s LEFT JOIN " + target_table_name + " j USING (";
 	if (!metadata.output_key_list_for_using(select_query, {})) {
@@ -426,11 +3030,12 @@ void compute_new_rows_on_db(Connection& conn, const TableMetadata& metadata, con
 
 	process_rows_from_query(conn, select_query, [&](const Row& row) {
 		// rows in source that are not yet in target database
-		print_insert(conn, metadata, row, target_table_name);
+		emitter.emit_insert(row);
 	});
 }
 
-void compute_old_rows_on_db(Connection& conn, const TableMetadata& metadata, const std::string& source_table_name, const std::string& target_table_name) {
+void compute_old_rows_on_db(Connection& conn, const TableMetadata& metadata, const std::string& source_table_name, const std::string& target_table_name,
+                            StatementEmitter& emitter) {
 	Query select_query = conn.query();
 	select_query << "SELECT t.* FROM " + target_table_name + " t LEFT JOIN " + source_table_name + " j USING (";
 	if (!metadata.output_key_list_for_using(select_query, {})) {
@@ -443,50 +3048,972 @@ void compute_old_rows_on_db(Connection& conn, const TableMetadata& metadata, con
 
 	process_rows_from_query(conn, select_query, [&](const Row& row) {
 		// rows in target that are not in source database anymore
-		print_delete(conn, metadata, row, target_table_name);
+		emitter.emit_delete(row);
+	});
+}
+
+void compute_table_diff_on_db(Connection& conn, const TableMetadata& metadata, const std::string& source_table_name, const std::string& target_table_name,
+                              StatementEmitter& emitter) {
+	compute_changed_rows_on_db(conn, metadata, source_table_name, target_table_name, emitter);
+	compute_new_rows_on_db(conn, metadata, source_table_name, target_table_name, emitter);
+	compute_old_rows_on_db(conn, metadata, source_table_name, target_table_name, emitter);
+}
+
+// the same, but with a single query emulating a full outer join, i.e. a LEFT JOIN finding both new and changed rows,
+// and an anti-join finding removed ones, so that each table is scanned twice instead of three times;
+// each row of the result is tagged with its operation in an additional column, after the columns of both tables
+void compute_table_diff_on_db_single_pass(Connection& conn, const TableMetadata& metadata,
+                                          const std::string& source_table_name, const std::string& target_table_name,
+                                          StatementEmitter& emitter) {
+	if (metadata.primary_keys().empty()) {
+		return;
+	}
+	Query select_query = conn.query();
+	select_query << "SELECT s.*, t.*, IF(";
+	metadata.output_missing_target_for_where(select_query);
+	select_query << ",'I','U') FROM " + source_table_name + " s LEFT JOIN " + target_table_name + " t USING (";
+	metadata.output_key_list_for_using(select_query, {});
+	select_query << ") WHERE ";
+	metadata.output_missing_target_for_where(select_query);
+	if (!metadata.non_primary_keys().empty()) {
+		select_query << " OR ";
+		metadata.output_diff_list_for_where(select_query, {});
+	}
+	// removed rows have the values of the target first, as these are the ones needed for DELETEs
+	select_query << " UNION ALL SELECT t.*, j.*, 'D' FROM " + target_table_name + " t LEFT JOIN " + source_table_name + " j USING (";
+	metadata.output_key_list_for_using(select_query, {});
+	select_query << ") WHERE ";
+	metadata.output_null_key_list_for_where(select_query, {});
+
+	const int operation_index = 2 * metadata.field_count;
+	std::vector<int> changed_indexes;
+	process_rows_from_query(conn, select_query, [&](const Row& row) {
+		switch (row[operation_index].data()[0]) {
+		case 'I':
+			emitter.emit_insert(row);
+			break;
+		case 'U':
+			changed_indexes.clear();
+			for (int index = 0; index < metadata.field_count; ++index) {
+				if (!metadata.is_generated(index) && !equals(row[index], row[index + metadata.field_count])) {
+					changed_indexes.push_back(index);
+				}
+			}
+			if (!changed_indexes.empty()) {
+				emitter.emit_update(row, changed_indexes);
+			}
+			break;
+		default:
+			emitter.emit_delete(row);
+			break;
+		}
 	});
 }
 
-void compute_table_diff_on_db(Connection& conn, const TableMetadata& metadata, const std::string& source_table_name, const std::string& target_table_name) {
-	compute_changed_rows_on_db(conn, metadata, source_table_name, target_table_name);
-	compute_new_rows_on_db(conn, metadata, source_table_name, target_table_name);
-	compute_old_rows_on_db(conn, metadata, source_table_name, target_table_name);
+// unbuffered stream buffer passing everything on to another stream, one write at a time, so that it can be shared
+class SharedStreambuf : public std::streambuf {
+	std::ostream& target;
+	std::mutex& mutex;
+
+protected:
+	std::streamsize xsputn(const char* data, std::streamsize length) override {
+		std::lock_guard<std::mutex> lock(mutex);
+		target.write(data, length);
+		return target ? length : 0;
+	}
+
+	int_type overflow(int_type c) override {
+		if (!traits_type::eq_int_type(c, traits_type::eof())) {
+			std::lock_guard<std::mutex> lock(mutex);
+			target.put(traits_type::to_char_type(c));
+		}
+		return traits_type::not_eof(c);
+	}
+
+public:
+	SharedStreambuf(std::ostream& target, std::mutex& mutex) : target(target), mutex(mutex) { }
+};
+
+// the same, but with the three queries running at the same time on separate connections; each of them has
+// its own emitter, and their statements are interleaved in blocks (of about a megabyte) of complete statements
+void compute_table_diff_on_db_concurrently(Connection& conn, const Config& config, const TableMetadata& metadata,
+                                           const std::string& source_table_name, const std::string& target_table_name,
+                                           StatementEmitter& emitter) {
+	using Step = void (*)(Connection&, const TableMetadata&, const std::string&, const std::string&, StatementEmitter&);
+	const std::array<Step, 3> steps = {compute_changed_rows_on_db, compute_new_rows_on_db, compute_old_rows_on_db};
+
+	// connections are opened upfront, as the client library does not like to be initialized concurrently
+	const std::array<std::shared_ptr<Connection>, 2> other_connections = {open_connection(config), open_connection(config)};
+	const std::array<Connection*, 3> connections = {&conn, other_connections[0].get(), other_connections[1].get()};
+
+	std::mutex mutex;
+	std::array<std::exception_ptr, 3> errors;
+	auto run = [&](size_t step) {
+		try {
+			SharedStreambuf shared(std::cout, mutex);
+			std::ostream out(&shared);
+			StatementEmitter step_emitter(emitter, out);
+			steps[step](*connections[step], metadata, source_table_name, target_table_name, step_emitter);
+			step_emitter.finish();
+		}
+		catch (...) {
+			errors[step] = std::current_exception();
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (size_t step = 1; step < steps.size(); ++step) {
+		threads.emplace_back([&run, step] {
+			Connection::thread_start();
+			run(step);
+			Connection::thread_end();
+		});
+	}
+	run(0);
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	for (const auto& error : errors) {
+		if (error) {
+			std::rethrow_exception(error);
+		}
+	}
+}
+
+#ifdef DBDPP_IO_URING
+// minimal io_uring with a single write in flight, set up with raw system calls so that liburing is not needed
+class IoUring {
+	int ring_fd = -1;
+	void* sq_ring = MAP_FAILED;
+	void* cq_ring = MAP_FAILED;
+	size_t sq_ring_size = 0;
+	size_t cq_ring_size = 0;
+	io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+	size_t sqes_size = 0;
+	unsigned* sq_head = nullptr;
+	unsigned* sq_tail = nullptr;
+	unsigned* sq_mask = nullptr;
+	unsigned* sq_array = nullptr;
+	unsigned* cq_head = nullptr;
+	unsigned* cq_tail = nullptr;
+	unsigned* cq_mask = nullptr;
+	io_uring_cqe* cqes = nullptr;
+
+	template <class T>
+	static T* at(void* ring, unsigned offset) {
+		return reinterpret_cast<T*>(static_cast<char*>(ring) + offset);
+	}
+
+public:
+	// returns false if the kernel does not support io_uring (or forbids it), so that write(2) can be used instead
+	bool open() {
+		io_uring_params params{};
+		ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, 4, &params));
+		// writing at the current file position is needed, as the output may be a pipe
+		if (ring_fd < 0 || !(params.features & IORING_FEAT_RW_CUR_POS)) {
+			return false;
+		}
+		sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+		if (single_mmap) {
+			sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+		}
+		sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+		if (sq_ring == MAP_FAILED) {
+			return false;
+		}
+		if (!single_mmap) {
+			cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+			if (cq_ring == MAP_FAILED) {
+				return false;
+			}
+		}
+		sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+		sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		                                       ring_fd, IORING_OFF_SQES));
+		if (sqes == MAP_FAILED) {
+			return false;
+		}
+		void* completions = single_mmap ? sq_ring : cq_ring;
+		sq_head = at<unsigned>(sq_ring, params.sq_off.head);
+		sq_tail = at<unsigned>(sq_ring, params.sq_off.tail);
+		sq_mask = at<unsigned>(sq_ring, params.sq_off.ring_mask);
+		sq_array = at<unsigned>(sq_ring, params.sq_off.array);
+		cq_head = at<unsigned>(completions, params.cq_off.head);
+		cq_tail = at<unsigned>(completions, params.cq_off.tail);
+		cq_mask = at<unsigned>(completions, params.cq_off.ring_mask);
+		cqes = at<io_uring_cqe>(completions, params.cq_off.cqes);
+		return true;
+	}
+
+	~IoUring() {
+		if (sqes != MAP_FAILED) {
+			munmap(sqes, sqes_size);
+		}
+		if (cq_ring != MAP_FAILED) {
+			munmap(cq_ring, cq_ring_size);
+		}
+		if (sq_ring != MAP_FAILED) {
+			munmap(sq_ring, sq_ring_size);
+		}
+		if (ring_fd >= 0) {
+			::close(ring_fd);
+		}
+	}
+
+	// the same as write(2), but returning -errno on failure
+	ssize_t write(int fd, const char* data, size_t length) {
+		unsigned tail = *sq_tail;
+		unsigned index = tail & *sq_mask;
+		io_uring_sqe& sqe = sqes[index];
+		std::memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_WRITE;
+		sqe.fd = fd;
+		sqe.addr = reinterpret_cast<uint64_t>(data);
+		sqe.len = static_cast<uint32_t>(std::min<size_t>(length, 1u << 30));
+		sqe.off = static_cast<uint64_t>(-1);
+		sq_array[index] = index;
+		__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+		// the wait may be interrupted after the entry has been submitted, so it is submitted again only if it has not
+		// been consumed yet, and the completion queue is checked until the completion is actually there
+		unsigned to_submit = 1;
+		while (true) {
+			unsigned head = __atomic_load_n(cq_head, __ATOMIC_ACQUIRE);
+			if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+				ssize_t result = cqes[head & *cq_mask].res;
+				__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+				return result;
+			}
+			if (syscall(__NR_io_uring_enter, ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0
+			    && errno != EINTR) {
+				return -errno;
+			}
+			to_submit = (__atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == tail + 1) ? 0 : 1;
+		}
+	}
+};
+#endif
+
+enum class Compression {
+	NONE, GZIP, ZSTD
+};
+
+// compresses a block into a complete, independent frame, so that the frames can simply be concatenated
+std::string compress_block(Compression compression, const std::string& block) {
+	std::string frame;
+	if (compression == Compression::GZIP) {
+		z_stream stream{};
+		// 16 added to the window bits selects the gzip wrapper
+		if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			throw std::runtime_error("cannot initialize gzip compression");
+		}
+		frame.resize(deflateBound(&stream, block.size()));
+		stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(block.data()));
+		stream.avail_in = static_cast<uInt>(block.size());
+		stream.next_out = reinterpret_cast<Bytef*>(&frame[0]);
+		stream.avail_out = static_cast<uInt>(frame.size());
+		int result = deflate(&stream, Z_FINISH);
+		frame.resize(stream.total_out);
+		deflateEnd(&stream);
+		if (result != Z_STREAM_END) {
+			throw std::runtime_error("gzip compression failed");
+		}
+	}
+#ifdef DBDPP_ZSTD
+	else if (compression == Compression::ZSTD) {
+		frame.resize(ZSTD_compressBound(block.size()));
+		size_t size = ZSTD_compress(&frame[0], frame.size(), block.data(), block.size(), ZSTD_CLEVEL_DEFAULT);
+		if (ZSTD_isError(size)) {
+			throw std::runtime_error(std::string("zstd compression failed: ") + ZSTD_getErrorName(size));
+		}
+		frame.resize(size);
+	}
+#endif
+	return frame;
+}
+
+// executes statements on the target server instead of writing them out; as many statements as fit into
+// max_allowed_packet are sent together in a single multi-statement packet, and committed in transactions
+// of the given number of statements
+class StatementApplier {
+	MYSQL* mysql;
+	const size_t packet_limit;
+	const size_t transaction_size;
+	std::string partial;
+	std::string packet;
+	size_t in_transaction = 0;
+	uint64_t statements = 0;
+	uint64_t transactions = 0;
+	uint64_t packets = 0;
+	uint64_t bytes_applied = 0;
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	void execute() {
+		if (mysql_real_query(mysql, packet.data(), packet.size()) != 0) {
+			throw std::runtime_error(std::string("cannot apply changes: ") + mysql_error(mysql));
+		}
+		// the server stops at the first failing statement, which is then reported by mysql_next_result
+		int status;
+		do {
+			if (MYSQL_RES* result = mysql_store_result(mysql)) {
+				mysql_free_result(result);
+			} else if (mysql_field_count(mysql) != 0) {
+				throw std::runtime_error(std::string("cannot apply changes: ") + mysql_error(mysql));
+			}
+		} while ((status = mysql_next_result(mysql)) == 0);
+		if (status > 0) {
+			throw std::runtime_error(std::string("cannot apply changes: ") + mysql_error(mysql));
+		}
+		bytes_applied += packet.size();
+		++packets;
+		packet.clear();
+	}
+
+	void append(const char* statement, size_t length) {
+		if (!packet.empty() && packet.size() + length > packet_limit) {
+			execute();
+		}
+		packet.append(statement, length);
+	}
+
+	void commit() {
+		static constexpr std::string_view COMMIT = "COMMIT;\n";
+		append(COMMIT.data(), COMMIT.size());
+		in_transaction = 0;
+		++transactions;
+	}
+
+	void add_statement(const char* statement, size_t length) {
+		static constexpr std::string_view BEGIN = "START TRANSACTION;\n";
+		if (in_transaction == 0) {
+			append(BEGIN.data(), BEGIN.size());
+		}
+		append(statement, length);
+		++statements;
+		if (++in_transaction == transaction_size) {
+			commit();
+		}
+	}
+
+public:
+	// the connection has to be opened with multiple statements enabled
+	StatementApplier(Connection& conn, size_t packet_limit, size_t transaction_size)
+		: mysql(conn.driver()->raw_handle()), packet_limit(packet_limit), transaction_size(transaction_size) {
+		// there are no gap locks then, so that appliers of neighbouring keys (see --apply-jobs) do not block each other
+		static constexpr std::string_view ISOLATION = "SET SESSION TRANSACTION ISOLATION LEVEL READ COMMITTED";
+		if (mysql_real_query(mysql, ISOLATION.data(), ISOLATION.size()) != 0) {
+			throw std::runtime_error(std::string("cannot apply changes: ") + mysql_error(mysql));
+		}
+	}
+
+	StatementApplier(const StatementApplier&) = delete;
+	StatementApplier& operator=(const StatementApplier&) = delete;
+
+	// takes any part of the output, executing the statements completed so far
+	void apply(const char* data, size_t length) {
+		// every statement ends with ";\n", which cannot occur inside of it, as line breaks in literals are escaped
+		partial.append(data, length);
+		size_t begin = 0;
+		size_t end;
+		while ((end = partial.find(";\n", begin)) != std::string::npos) {
+			add_statement(partial.data() + begin, end + 2 - begin);
+			begin = end + 2;
+		}
+		partial.erase(0, begin);
+	}
+
+	[[nodiscard]] bool idle() const {
+		return in_transaction == 0 && packet.empty();
+	}
+
+	// commits the open transaction, without waiting for it to reach its size, or for its packet to fill up
+	void flush() {
+		if (in_transaction > 0) {
+			commit();
+		}
+		if (!packet.empty()) {
+			execute();
+		}
+	}
+
+	// commits the last transaction
+	void finish() {
+		if (partial.find_first_not_of(" \t\r\n") != std::string::npos) {
+			throw std::runtime_error("cannot apply changes: incomplete statement at the end");
+		}
+		flush();
+	}
+
+	// reports the throughput on the standard error
+	void report() const {
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cerr << "applied " << statements << " statements in " << transactions << " transactions ("
+			<< packets << " packets, " << bytes_applied << " bytes) in " << seconds << " s ("
+			<< static_cast<uint64_t>(statements / std::max(seconds, 1e-6)) << " statements/s, "
+			<< static_cast<uint64_t>(bytes_applied / std::max(seconds, 1e-6) / 1e6) << " MB/s)" << std::endl;
+	}
+};
+
+// buffer for std::cout, which hands over multi-megabyte blocks to separate threads, so that generating statements
+// can go on in the meantime; blocks are compressed in parallel if requested, and written out in order by a single thread
+// (or executed on the target server by that thread, if an applier is given)
+class OutputSink : public std::streambuf {
+	static constexpr size_t BUFFER_SIZE = 8 << 20;
+
+	int fd;
+	const bool owns_fd;
+	const Compression compression;
+	StatementApplier* const applier;
+	// blocks which are filled, compressed or waiting to be written, at most
+	const size_t max_pending;
+	std::string filling;
+	size_t blocks_handed_over = 0;
+	size_t blocks_written = 0;
+	std::deque<std::pair<size_t, std::string>> uncompressed;
+	std::map<size_t, std::string> ready;
+	std::vector<std::string> spare;
+	bool closing = false;
+	bool abandoned = false;
+	// whether the last block has been handed over successfully by start_closing()
+	bool flushed = false;
+	std::exception_ptr error;
+	std::mutex mutex;
+	std::condition_variable condition;
+	uint64_t bytes_generated = 0;
+	uint64_t bytes_written = 0;
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+#ifdef DBDPP_IO_URING
+	std::unique_ptr<IoUring> ring;
+#endif
+	std::vector<std::thread> threads;
+	std::ostream* redirected = nullptr;
+	std::streambuf* previous = nullptr;
+
+	void write_fully(const char* data, size_t length) {
+		while (length > 0) {
+			ssize_t written;
+#ifdef DBDPP_IO_URING
+			if (ring) {
+				written = ring->write(fd, data, length);
+				if (written == -EINVAL) {
+					// kernels before 5.6 have io_uring, but without IORING_OP_WRITE
+					ring.reset();
+					continue;
+				}
+				if (written < 0) {
+					errno = static_cast<int>(-written);
+					written = -1;
+				}
+			} else
+#endif
+			{
+				written = ::write(fd, data, length);
+			}
+			if (written < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				throw std::runtime_error(std::string("cannot write output: ") + std::strerror(errno));
+			}
+			data += written;
+			length -= static_cast<size_t>(written);
+		}
+	}
+
+	void fail(std::unique_lock<std::mutex>& lock) {
+		if (!lock) {
+			lock.lock();
+		}
+		if (!error) {
+			error = std::current_exception();
+		}
+		condition.notify_all();
+	}
+
+	void compress_blocks() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			condition.wait(lock, [&] { return !uncompressed.empty() || closing || error; });
+			if (uncompressed.empty() || error) {
+				return;
+			}
+			auto [index, block] = std::move(uncompressed.front());
+			uncompressed.pop_front();
+			lock.unlock();
+			try {
+				std::string frame = compress_block(compression, block);
+				lock.lock();
+				ready.emplace(index, std::move(frame));
+				spare.push_back(std::move(block));
+				condition.notify_all();
+			}
+			catch (...) {
+				fail(lock);
+				return;
+			}
+		}
+	}
+
+	void write_ready_blocks() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			if (applier && !ready.count(blocks_written) && !closing && !error && !applier->idle()) {
+				// nothing else to apply for now, so the open transaction is committed instead of holding its locks
+				lock.unlock();
+				try {
+					applier->flush();
+				}
+				catch (...) {
+					fail(lock);
+					return;
+				}
+				lock.lock();
+				continue;
+			}
+			condition.wait(lock, [&] {
+				return ready.count(blocks_written) || (closing && blocks_written == blocks_handed_over) || error;
+			});
+			if (error) {
+				return;
+			}
+			if (!ready.count(blocks_written)) {
+				// each applier commits its last transaction on its own, so that they are not committed one by one
+				if (applier && !abandoned) {
+					lock.unlock();
+					try {
+						applier->finish();
+					}
+					catch (...) {
+						fail(lock);
+					}
+				}
+				return;
+			}
+			std::string block = std::move(ready[blocks_written]);
+			ready.erase(blocks_written);
+			lock.unlock();
+			try {
+				if (applier) {
+					applier->apply(block.data(), block.size());
+				} else {
+					write_fully(block.data(), block.size());
+				}
+			}
+			catch (...) {
+				fail(lock);
+				return;
+			}
+			lock.lock();
+			bytes_written += block.size();
+			++blocks_written;
+			if (compression == Compression::NONE) {
+				spare.push_back(std::move(block));
+			}
+			condition.notify_all();
+		}
+	}
+
+	void write_blocks() {
+		if (applier) {
+			Connection::thread_start();
+			write_ready_blocks();
+			Connection::thread_end();
+		} else {
+			write_ready_blocks();
+		}
+	}
+
+	// passes the current block on (unless it is empty), waiting if too many blocks are already pending
+	bool hand_over() {
+		std::unique_lock<std::mutex> lock(mutex);
+		condition.wait(lock, [&] { return blocks_handed_over - blocks_written < max_pending || error; });
+		if (error) {
+			return false;
+		}
+		filling.resize(pptr() - pbase());
+		if (!filling.empty()) {
+			bytes_generated += filling.size();
+			if (compression == Compression::NONE) {
+				ready.emplace(blocks_handed_over++, std::move(filling));
+			} else {
+				uncompressed.emplace_back(blocks_handed_over++, std::move(filling));
+			}
+			if (!spare.empty()) {
+				filling = std::move(spare.back());
+				spare.pop_back();
+			} else {
+				filling = std::string();
+			}
+			condition.notify_all();
+		}
+		filling.resize(BUFFER_SIZE);
+		setp(&filling[0], &filling[0] + filling.size());
+		return true;
+	}
+
+protected:
+	int_type overflow(int_type c) override {
+		if (!hand_over()) {
+			return traits_type::eof();
+		}
+		if (!traits_type::eq_int_type(c, traits_type::eof())) {
+			*pptr() = traits_type::to_char_type(c);
+			pbump(1);
+		}
+		return traits_type::not_eof(c);
+	}
+
+	int sync() override {
+		return hand_over() ? 0 : -1;
+	}
+
+public:
+	// writes to the given file, or to the standard output if the path is empty, unless an applier is given
+	OutputSink(const std::string& path, Compression compression, StatementApplier* applier = nullptr)
+		: fd(path.empty() ? STDOUT_FILENO : ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)),
+		  owns_fd(!path.empty()), compression(compression), applier(applier),
+		  max_pending(2 * std::max(1u, (compression == Compression::NONE) ? 1u : std::thread::hardware_concurrency())) {
+		if (fd < 0) {
+			throw std::runtime_error("cannot open " + path + ": " + std::strerror(errno));
+		}
+#ifdef DBDPP_IO_URING
+		if (owns_fd) {
+			ring = std::make_unique<IoUring>();
+			if (!ring->open()) {
+				ring.reset();
+			}
+		}
+#endif
+		filling.resize(BUFFER_SIZE);
+		setp(&filling[0], &filling[0] + filling.size());
+		threads.emplace_back(&OutputSink::write_blocks, this);
+		if (compression != Compression::NONE) {
+			for (size_t i = 0; i < max_pending / 2; ++i) {
+				threads.emplace_back(&OutputSink::compress_blocks, this);
+			}
+		}
+	}
+
+	~OutputSink() override {
+		if (!threads.empty()) {
+			try {
+				// the last transaction is left uncommitted, so that it gets rolled back
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					abandoned = true;
+				}
+				close();
+			}
+			catch (...) {
+				// errors are reported only if close() is called explicitly
+			}
+		}
+	}
+
+	OutputSink(const OutputSink&) = delete;
+	OutputSink& operator=(const OutputSink&) = delete;
+
+	// makes the stream write into this sink until it is closed
+	void redirect(std::ostream& stream) {
+		redirected = &stream;
+		previous = stream.rdbuf(this);
+	}
+
+	// hands over the last block, and lets the threads finish on their own (e.g. with a few sinks to be closed)
+	void start_closing() {
+		if (closing) {
+			return;
+		}
+		flushed = hand_over();
+		std::lock_guard<std::mutex> lock(mutex);
+		closing = true;
+		condition.notify_all();
+	}
+
+	// writes out everything that is left, and reports the throughput on the standard error
+	void close() {
+		start_closing();
+		for (auto& thread : threads) {
+			thread.join();
+		}
+		threads.clear();
+		if (redirected) {
+			redirected->rdbuf(previous);
+			redirected = nullptr;
+		}
+		if (owns_fd && ::close(fd) != 0 && !error) {
+			throw std::runtime_error(std::string("cannot write output: ") + std::strerror(errno));
+		}
+		if (error) {
+			std::rethrow_exception(error);
+		}
+		if (!flushed) {
+			throw std::runtime_error("cannot write output");
+		}
+		if (applier) {
+			if (!abandoned) {
+				applier->report();
+			}
+			return;
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cerr << "written " << bytes_written << " bytes";
+		if (compression != Compression::NONE) {
+			std::cerr << " (compressed from " << bytes_generated << ")";
+		}
+		std::cerr << " in " << seconds << " s ("
+			<< static_cast<uint64_t>(bytes_generated / std::max(seconds, 1e-6) / 1e6) << " MB/s)" << std::endl;
+	}
+};
+
+struct Options {
+	bool merge = false;
+	bool digest = false;
+	bool checksum = false;
+	bool binary = false;
+	int jobs = 1;
+	std::string output;
+	Compression compression = Compression::NONE;
+	bool batch = false;
+	size_t batch_bytes = 0;
+	bool upsert = false;
+	std::string staging;
+	bool ordered = false;
+	bool single_pass = false;
+	bool apply = false;
+	int apply_jobs = 1;
+	size_t transaction_size = 1000;
+};
+
+void print_usage() {
+	std::cerr << "USAGE: dbdpp [ options ] [ source.cnf ] target.cnf source_table_name target_table_name\n"
+		<< "\t(source.cnf and target.cnf should be MySQL-style configuration files)\n"
+		<< "OPTIONS:\n"
+		<< "\t--merge\tread both tables in primary key order and merge them on the fly (requires source.cnf)\n"
+		<< "\t--digest\tkeep only primary keys and digests of target rows in memory (requires source.cnf)\n"
+		<< "\t--checksum\tcompare checksums of key ranges and fetch only the differing ones (requires source.cnf)\n"
+		<< "\t--jobs N\tsplit tables into chunks of primary keys and merge them in N threads\n"
+		<< "\t--single-pass\tfind all differences with a single query emulating a full outer join (requires no source.cnf)\n"
+		<< "\t--binary\tfetch rows with prepared statements, comparing numbers and dates in binary form (requires source.cnf)\n"
+		<< "\t--output FILE\twrite statements to FILE instead of the standard output\n"
+		<< "\t--compress gzip|zstd\tcompress the statements in parallel, as independent frames\n"
+		<< "\t--batch\tmerge INSERTs, DELETEs and identical UPDATEs into multi-row statements, fitting into max_allowed_packet of target\n"
+		<< "\t--batch-bytes N\tthe same, but with statements of at most N bytes\n"
+		<< "\t--upsert\twrite both new and changed rows as INSERT ... ON DUPLICATE KEY UPDATE\n"
+		<< "\t--staging DIR\twrite rows to TSV files in DIR, and a script applying them through temporary tables\n"
+		<< "\t--ordered\twrite DELETEs, UPDATEs and INSERTs in separate groups, each one sorted by primary keys\n"
+		<< "\t--apply\texecute the statements on target instead of writing them, in multi-statement packets\n"
+		<< "\t--apply-jobs N\tthe same, but on N connections, each one getting rows with a different hash of primary keys\n"
+		<< "\t--transaction-size N\tcommit applied changes every N statements (1000 by default)" << std::endl;
 }
 
 int main(int argc, char** argv) {
-	if (argc < 4 || argc > 5) {
-		std::cerr << "USAGE: dbdpp [ source.cnf ] target.cnf source_table_name target_table_name\n"
-			<< "\t(source.cnf and target.cnf should be MySQL-style configuration files)" << std::endl;
+	Options options;
+	std::vector<std::string> args;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--merge") {
+			options.merge = true;
+		} else if (arg == "--digest") {
+			options.digest = true;
+		} else if (arg == "--checksum") {
+			options.checksum = true;
+		} else if (arg == "--single-pass") {
+			options.single_pass = true;
+		} else if (arg == "--binary") {
+			options.binary = true;
+		} else if (arg == "--jobs" && i + 1 < argc) {
+			options.jobs = std::atoi(argv[++i]);
+			if (options.jobs < 1) {
+				std::cerr << "ERROR! --jobs requires a positive number" << std::endl;
+				return 1;
+			}
+		} else if (arg == "--staging" && i + 1 < argc) {
+			options.staging = argv[++i];
+		} else if (arg == "--ordered") {
+			options.ordered = true;
+		} else if (arg == "--apply") {
+			options.apply = true;
+		} else if (arg == "--apply-jobs" && i + 1 < argc) {
+			options.apply = true;
+			options.apply_jobs = std::atoi(argv[++i]);
+			if (options.apply_jobs < 1) {
+				std::cerr << "ERROR! --apply-jobs requires a positive number" << std::endl;
+				return 1;
+			}
+		} else if (arg == "--transaction-size" && i + 1 < argc) {
+			options.transaction_size = std::strtoull(argv[++i], nullptr, 10);
+			if (!options.transaction_size) {
+				std::cerr << "ERROR! --transaction-size requires a positive number" << std::endl;
+				return 1;
+			}
+		} else if (arg == "--upsert") {
+			options.upsert = true;
+		} else if (arg == "--batch") {
+			options.batch = true;
+		} else if (arg == "--batch-bytes" && i + 1 < argc) {
+			options.batch = true;
+			options.batch_bytes = std::strtoull(argv[++i], nullptr, 10);
+			if (!options.batch_bytes) {
+				std::cerr << "ERROR! --batch-bytes requires a positive number" << std::endl;
+				return 1;
+			}
+		} else if (arg == "--output" && i + 1 < argc) {
+			options.output = argv[++i];
+		} else if (arg == "--compress" && i + 1 < argc) {
+			std::string name = argv[++i];
+			if (name == "gzip") {
+				options.compression = Compression::GZIP;
+			} else if (name == "zstd") {
+#ifdef DBDPP_ZSTD
+				options.compression = Compression::ZSTD;
+#else
+				std::cerr << "ERROR! dbdpp was built without zstd support" << std::endl;
+				return 1;
+#endif
+			} else {
+				std::cerr << "ERROR! --compress requires gzip or zstd" << std::endl;
+				return 1;
+			}
+		} else if (arg.compare(0, 2, "--") == 0) {
+			std::cerr << "ERROR! unknown option " << arg << std::endl;
+			print_usage();
+			return 1;
+		} else {
+			args.push_back(std::move(arg));
+		}
+	}
+	if (args.size() < 3 || args.size() > 4) {
+		print_usage();
 		return 1;
 	}
+	const bool two_servers = (args.size() == 4);
 
 	try {
-		Config source = ConfigParser(argv[1]).parse_config();
-		Config target = ConfigParser(argv[argc-3]).parse_config();
-		const char* source_table_name = argv[argc-2];
-		const char* target_table_name = argv[argc-1];
+		if ((options.merge || options.digest || options.checksum) && !two_servers) {
+			throw std::runtime_error("--merge, --digest and --checksum require source.cnf to be given");
+		}
+		if (options.merge + options.digest + options.checksum > 1) {
+			throw std::runtime_error("only one of --merge, --digest and --checksum can be used");
+		}
+		if (options.single_pass && (two_servers || options.jobs > 1)) {
+			throw std::runtime_error("--single-pass cannot be used with source.cnf or --jobs");
+		}
+		if (options.jobs > 1 && (options.digest || options.checksum)) {
+			throw std::runtime_error("--jobs cannot be used with --digest or --checksum");
+		}
+		if (options.binary && (!two_servers || options.merge || options.checksum || options.jobs > 1)) {
+			throw std::runtime_error("--binary can be used only when whole tables are compared in memory");
+		}
+		if (!options.staging.empty() && (options.batch || options.upsert || options.jobs > 1)) {
+			throw std::runtime_error("--staging cannot be used with --batch, --upsert or --jobs");
+		}
+		if (options.apply && (!options.staging.empty() || !options.output.empty() || options.compression != Compression::NONE)) {
+			throw std::runtime_error("--apply cannot be used with --staging, --output or --compress");
+		}
+		Config source = ConfigParser(args.front()).parse_config();
+		Config target = ConfigParser(args[args.size()-3]).parse_config();
+		const std::string& source_table_name = args[args.size()-2];
+		const std::string& target_table_name = args[args.size()-1];
 
 		std::shared_ptr<Connection> source_conn, target_conn;
-		target_conn = std::make_shared<Connection>(target.database.c_str(), target.host.c_str(), target.user.c_str(), target.password.c_str());
-		if (argc == 5) {
-			source_conn = std::make_shared<Connection>(source.database.c_str(), source.host.c_str(), source.user.c_str(), source.password.c_str());
+		target_conn = open_connection(target);
+		if (two_servers) {
+			source_conn = open_connection(source);
 		} else {
 			source_conn = target_conn;
 		}
 
 		TableMetadata metadata = extract_table_metadata(*target_conn, target_table_name);
-		if (extract_table_metadata(*source_conn, source_table_name) != metadata) {
+		TableMetadata source_metadata = extract_table_metadata(*source_conn, source_table_name);
+		if (source_metadata != metadata) {
 			throw std::runtime_error("table definitions differ");
 		}
+		metadata.allow_nulls_of(source_metadata);
+
+		// changes are applied on connections of their own, as the others are busy reading rows at the same time
+		std::vector<std::shared_ptr<Connection>> apply_conns;
+		std::vector<std::unique_ptr<StatementApplier>> appliers;
+		for (int job = 0; options.apply && job < options.apply_jobs; ++job) {
+			apply_conns.push_back(open_connection(target, true));
+			appliers.push_back(std::make_unique<StatementApplier>(*apply_conns.back(), max_statement_size(*apply_conns.back()),
+			                                                      options.transaction_size));
+		}
+
+		// with more than one applier, each of them gets a stream (and a bounded queue of blocks) of its own
+		std::vector<std::unique_ptr<OutputSink>> sinks;
+		std::vector<std::unique_ptr<std::ostream>> streams;
+		if (appliers.size() <= 1) {
+			sinks.push_back(std::make_unique<OutputSink>(options.output, options.compression,
+			                                             appliers.empty() ? nullptr : appliers.front().get()));
+			sinks.front()->redirect(std::cout);
+		} else {
+			for (auto& applier : appliers) {
+				sinks.push_back(std::make_unique<OutputSink>(std::string(), Compression::NONE, applier.get()));
+				streams.push_back(std::make_unique<std::ostream>(sinks.back().get()));
+			}
+		}
+		StatementEmitter emitter(*source_conn, metadata, target_table_name);
+		if (options.batch) {
+			emitter.set_batch_limit(options.batch_bytes ? options.batch_bytes : max_statement_size(*target_conn));
+		}
+		if (options.upsert) {
+			emitter.set_upsert();
+		}
+		if (!options.staging.empty()) {
+			emitter.set_staging(options.staging, target_table_name);
+		}
+		if (options.ordered) {
+			emitter.set_ordered();
+		}
+		if (!streams.empty()) {
+			std::vector<std::ostream*> partition_streams;
+			for (auto& stream : streams) {
+				partition_streams.push_back(stream.get());
+			}
+			emitter.set_partitions(partition_streams);
+		}
 
-		if (argc == 5) {
-			TableData data_in_target = fetch_table_data(*target_conn, metadata, target_table_name);
-			compute_table_diff(*source_conn, metadata, source_table_name, data_in_target);
+		if (options.jobs > 1) {
+			compute_table_diff_parallel(*source_conn, source, target, metadata, source_table_name, target_table_name, options.jobs,
+			                            emitter);
+
+		} else if (options.merge) {
+			compute_table_diff_merge(*source_conn, *target_conn, metadata, source_table_name, target_table_name, emitter);
+
+		} else if (options.checksum) {
+			compute_table_diff_checksum(*source_conn, *target_conn, metadata, source_table_name, target_table_name, emitter);
+
+		} else if (two_servers) {
+			if (options.binary) {
+				compute_table_diff_in_memory<BinaryResult>(*source_conn, *target_conn, metadata,
+				                                           source_table_name, target_table_name, options.digest, emitter);
+			} else {
+				compute_table_diff_in_memory<RawResult>(*source_conn, *target_conn, metadata,
+				                                        source_table_name, target_table_name, options.digest, emitter);
+			}
+
+		} else if (options.single_pass) {
+			compute_table_diff_on_db_single_pass(*target_conn, metadata, source_table_name, target_table_name, emitter);
+
+		} else if (options.staging.empty() && !options.ordered) {
+			compute_table_diff_on_db_concurrently(*target_conn, target, metadata, source_table_name, target_table_name, emitter);
 
 		} else {
-			compute_table_diff_on_db(*target_conn, metadata, source_table_name, target_table_name);
+			// staged rows all go to the files of a single emitter, and ordered ones are held back by a single one
+			compute_table_diff_on_db(*target_conn, metadata, source_table_name, target_table_name, emitter);
 
 		}
+		emitter.finish();
+		// the appliers commit their last transactions at the same time, as they may be waiting for each other's locks
+		for (auto& sink : sinks) {
+			sink->start_closing();
+		}
+		for (auto& sink : sinks) {
+			sink->close();
+		}
 	}
 	catch (const std::exception& e) {
 		std::cerr << "ERROR! " << e.what() << std::endl;
@@ -0,0 +1,116 @@
+#!/bin/sh
+# End-to-end tests of dbdpp against a MySQL server. The database given in the client configuration file
+# $DBDPP_TEST_CNF is used as a scratch space for tables named dbdpp_test_*; without it the tests are skipped.
+# The same configuration serves as both source.cnf and target.cnf in the two-server mode.
+#
+#   DBDPP_TEST_CNF=test.cnf tests/integration.sh ./dbdpp
+set -eu
+
+DBDPP=${1:?usage: $0 path/to/dbdpp}
+if [ -z "${DBDPP_TEST_CNF:-}" ]; then
+	echo "DBDPP_TEST_CNF is not set, skipping"
+	exit 77
+fi
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+sql() {
+	mysql --defaults-extra-file="$DBDPP_TEST_CNF" -N -B -e "$1"
+}
+
+checksum() {
+	sql "CHECKSUM TABLE $1" | cut -f2
+}
+
+# sets up the tables with the current fixture, runs dbdpp with the given source configuration ("-" for the one-server
+# mode) and options, applies its output, and checks that both tables are equal then
+check() {
+	name=$1
+	source_cnf=$2
+	shift 2
+	$fixture
+	if [ "$source_cnf" = "-" ]; then
+		"$DBDPP" "$@" "$DBDPP_TEST_CNF" dbdpp_test_source dbdpp_test_target > "$TMP/out"
+	else
+		"$DBDPP" "$@" "$source_cnf" "$DBDPP_TEST_CNF" dbdpp_test_source dbdpp_test_target > "$TMP/out"
+	fi
+	case " $* " in
+	*" --compress gzip "*) gunzip -c "$TMP/out" > "$TMP/out.sql" ;;
+	*) mv "$TMP/out" "$TMP/out.sql" ;;
+	esac
+	mysql --defaults-extra-file="$DBDPP_TEST_CNF" --local-infile=1 < "$TMP/out.sql"
+	if [ "$(checksum dbdpp_test_source)" != "$(checksum dbdpp_test_target)" ]; then
+		echo "FAILED: $name ($fixture)"
+		exit 1
+	fi
+	echo "passed: $name ($fixture)"
+}
+
+# 10000 numbers, from 0 to 9999
+NUMBERS="(SELECT a.d + 10 * b.d + 100 * c.d + 1000 * e.d AS n FROM dbdpp_test_digits a, dbdpp_test_digits b,
+	dbdpp_test_digits c, dbdpp_test_digits e)"
+sql "DROP TABLE IF EXISTS dbdpp_test_digits;
+	CREATE TABLE dbdpp_test_digits (d INT);
+	INSERT INTO dbdpp_test_digits VALUES (0),(1),(2),(3),(4),(5),(6),(7),(8),(9);"
+
+# composite primary keys, also with decimals (including negative ones, and ones of different lengths),
+# with rows to be inserted, updated and deleted
+composite_tables() {
+	sql "DROP TABLE IF EXISTS dbdpp_test_source, dbdpp_test_target;
+		CREATE TABLE dbdpp_test_source (a INT, d DECIMAL(6,2), b VARCHAR(20), v VARCHAR(100), PRIMARY KEY (a, d, b));
+		CREATE TABLE dbdpp_test_target LIKE dbdpp_test_source;
+		INSERT INTO dbdpp_test_source
+			SELECT n DIV 100, (n MOD 20) - 8.5, CONCAT('k', n MOD 100), CONCAT('v', n) FROM $NUMBERS s WHERE n < 3000;
+		INSERT INTO dbdpp_test_target SELECT * FROM dbdpp_test_source WHERE a % 3 <> 0;
+		UPDATE dbdpp_test_target SET v = 'changed' WHERE a % 5 = 1;
+		INSERT INTO dbdpp_test_target VALUES (1000, 0, 'k0', 'old'), (1000, -1.5, 'k1', 'old'), (1001, 10.5, 'k0', 'old');"
+}
+
+# several megabytes of INSERTs, together with UPDATEs and DELETEs of contiguous keys, so that statements
+# of different kinds are interleaved, and ranges of deleted keys span blocks of different appliers
+large_tables() {
+	sql "DROP TABLE IF EXISTS dbdpp_test_source, dbdpp_test_target;
+		CREATE TABLE dbdpp_test_source (id INT PRIMARY KEY, v VARCHAR(400));
+		CREATE TABLE dbdpp_test_target LIKE dbdpp_test_source;
+		INSERT INTO dbdpp_test_source SELECT n, REPEAT(CHAR(97 + n % 26), 300) FROM $NUMBERS s;
+		INSERT INTO dbdpp_test_target SELECT id, IF(id % 7 = 0, 'changed', v) FROM dbdpp_test_source WHERE id % 2 = 0;
+		INSERT INTO dbdpp_test_target SELECT n + 10000, 'old' FROM $NUMBERS s WHERE n < 3000;"
+}
+
+# secondary unique values which are freed by a DELETE and an UPDATE, and taken by INSERTs,
+# so that the statements succeed only in the order of --ordered
+unique_tables() {
+	sql "DROP TABLE IF EXISTS dbdpp_test_source, dbdpp_test_target;
+		CREATE TABLE dbdpp_test_source (id INT PRIMARY KEY, u INT NOT NULL UNIQUE);
+		CREATE TABLE dbdpp_test_target LIKE dbdpp_test_source;
+		INSERT INTO dbdpp_test_source VALUES (1, 10), (3, 3), (4, 1), (5, 2);
+		INSERT INTO dbdpp_test_target VALUES (1, 1), (2, 2), (3, 3);"
+}
+
+LOCAL_INFILE=$(sql "SELECT @@local_infile")
+
+for fixture in composite_tables large_tables; do
+	for engine in "" "--merge" "--digest" "--checksum" "--jobs 4" "--binary" "--binary --digest"; do
+		check "two servers $engine" "$DBDPP_TEST_CNF" $engine
+		check "two servers $engine, batched" "$DBDPP_TEST_CNF" $engine --batch
+	done
+	for mode in "" "--single-pass" "--jobs 4" "--ordered" "--upsert" "--compress gzip"; do
+		check "one server $mode" - $mode
+		check "one server $mode, batched" - $mode --batch
+	done
+	if [ "$LOCAL_INFILE" = "1" ]; then
+		mkdir -p "$TMP/staging"
+		check "one server, staged" - --staging "$TMP/staging"
+	fi
+	check "applied" - --batch --apply
+	check "applied in parallel" - --batch --apply-jobs 4 --transaction-size 3
+	check "two servers, merged and applied in parallel" "$DBDPP_TEST_CNF" --merge --batch --apply-jobs 4
+done
+
+fixture=unique_tables
+check "ordered" - --ordered
+check "ordered, batched" - --ordered --batch
+check "two servers, merged, ordered and batched" "$DBDPP_TEST_CNF" --merge --ordered --batch
+
+sql "DROP TABLE IF EXISTS dbdpp_test_source, dbdpp_test_target, dbdpp_test_digits;"